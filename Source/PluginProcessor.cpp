@@ -9,9 +9,12 @@
 #include "PluginProcessor.h"
 
 //==============================================================================
-StreamingDemoAudioProcessor::StreamingDemoAudioProcessor():
-	backgroundThread(new ThreadPool())
+StreamingDemoAudioProcessor::StreamingDemoAudioProcessor()
 {
+	// Two voices are spare voices, so stolen notes can be faded out while the new note starts.
+	synth.setNumVoices(6);
+	synth.setMaxPolyphony(4);
+
 	// Make a simple key map for the sound
 	BigInteger map;
 	map.setRange(0, 127, false);
@@ -20,7 +23,7 @@ StreamingDemoAudioProcessor::StreamingDemoAudioProcessor():
 	try
 	{
 		// Add the sampler sound to the synth
-		synth.addSound(new StreamingSamplerSound(File(path), map, 60));
+		synth.loadSound(File(path), map, 60);
 	}
 	catch(LoadingError error)
 	{
@@ -32,42 +35,21 @@ StreamingDemoAudioProcessor::StreamingDemoAudioProcessor():
 	}
 
 	// Uncomment this to load everything into memory
-	//dynamic_cast<StreamingSamplerSound*>(synth.getSound(0))->loadEntireSample();
-
-	for(int i = 0; i < 4; ++i)
-	{
-		// Add a sampler voice and pass the background thread
-		synth.addVoice(new StreamingSamplerVoice(backgroundThread));
-	}
+	//dynamic_cast<StreamingSoundMapping*>(synth.getSound(0))->getStreamingSound()->loadEntireSample();
 }
 
 StreamingDemoAudioProcessor::~StreamingDemoAudioProcessor()
 {
 	synth.clearSounds();
-	synth.clearVoices();
 }
 
 void StreamingDemoAudioProcessor::prepareToPlay (double sampleRate, int samplesPerBlock)
 {
-	synth.setCurrentPlaybackSampleRate(sampleRate);
-
-	for(int i = 0; i < synth.getNumVoices(); i++)
-	{
-		StreamingSamplerVoice *v = dynamic_cast<StreamingSamplerVoice*>(synth.getVoice(i));
-
-		// You have to call prepareToPlay for each SamplerVoice since it initializes its internal buffers.
-		v->prepareToPlay(sampleRate, samplesPerBlock);
-
-		// This sets the buffer size of the internal stream buffers so that it loads
-		// new data about every 32 blocks.
-		v->setLoaderBufferSize(samplesPerBlock * 32);
-	}
-
-	// The preload buffer must be as big as the stream buffer, so whenever you change the stream buffers, 
-	// check that it does not exceed the preload buffer.
-	StreamingSamplerSound *s = dynamic_cast<StreamingSamplerSound*>(synth.getSound(0));
-	s->setPreloadSize(jmax(PRELOAD_SIZE, samplesPerBlock * 32));
+	// Wait for the disk instead of dropping out if the host renders faster than realtime
+	synth.setOfflineMode(isNonRealtime());
 
+	// This sets the sample rate, the stream buffer size and the preload sizes of all sounds
+	synth.prepareToPlay(sampleRate, samplesPerBlock);
 }
 
 void StreamingDemoAudioProcessor::processBlock (AudioSampleBuffer& buffer, MidiBuffer& midiMessages)
@@ -79,14 +61,7 @@ void StreamingDemoAudioProcessor::processBlock (AudioSampleBuffer& buffer, MidiB
 	
 #if DEBUG_DISK_USAGE
 
-	double usage = 0.0;
-
-	for(int i = 0; i < synth.getNumVoices(); i++)
-	{
-		usage += dynamic_cast<StreamingSamplerVoice*>(synth.getVoice(i))->getDiskUsage();
-	}
-
-	DBG("Disk usage: " + String(usage, 3));
+	DBG("Disk usage: " + String(synth.getDiskUsage(), 3));
 
 #endif
     
@@ -77,11 +77,8 @@ public:
 
 private:
 
-	// The Synthesiser that will play the streaming sounds;
-	Synthesiser synth;
-
-	// The ThreadPool that will manage the background reading
-	ScopedPointer<ThreadPool> backgroundThread;
+	// The sampler engine that will play the streaming sounds (it owns the voices and the background thread)
+	StreamingSampler synth;
 
     //==============================================================================
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (StreamingDemoAudioProcessor)
@@ -10,322 +10,3612 @@
 
 #include "StreamingSampler.h"
 
+#if LOCK_AUDIO_MEMORY && JUCE_WINDOWS
+#include <windows.h>
+#elif LOCK_AUDIO_MEMORY
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#if JUCE_INTEL
+#if JUCE_MSVC
+#include <intrin.h>
+#endif
+#include <immintrin.h>
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#define ZERO_COPY_STREAMING_AVAILABLE (USE_ZERO_COPY_STREAMING && LOCK_AUDIO_MEMORY && (JUCE_LINUX || JUCE_MAC))
+
+#if JUCE_WINDOWS
+#include <windows.h>
+#elif JUCE_MAC
+#include <mach/mach.h>
+#else
+#include <semaphore.h>
+#include <time.h>
+#include <errno.h>
+#endif
+
+#define SHARED_PRELOAD_MEMORY_AVAILABLE (USE_SHARED_PRELOAD_MEMORY && (JUCE_LINUX || JUCE_MAC))
+
+#if SHARED_PRELOAD_MEMORY_AVAILABLE
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// ==================================================================================================== ResidentMemoryLock methods
+
+int64 ResidentMemoryLock::memoryBudget = DEFAULT_PRELOAD_BUDGET;
+Atomic<int64> ResidentMemoryLock::totalLockedBytes;
+
+ResidentMemoryLock::ResidentMemoryLock(const void *data, size_t numBytes):
+	lockedData(nullptr),
+	numLockedBytes(0)
+{
+#if LOCK_AUDIO_MEMORY
+
+#if JUCE_WINDOWS
+	SYSTEM_INFO systemInfo;
+	GetSystemInfo(&systemInfo);
+	const size_t pageSize = (size_t)systemInfo.dwPageSize;
+#else
+	const size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+#endif
+
+	// Only the pages that lie completely inside the region are locked
+	const size_t start = ((size_t)data + pageSize - 1) & ~(pageSize - 1);
+	const size_t end = ((size_t)data + numBytes) & ~(pageSize - 1);
+
+	if(data == nullptr || end <= start) return;
+
+	const size_t size = end - start;
+
+	// The size is reserved before the pages are locked, so concurrent locks can't exceed the budget together
+	for(;;)
+	{
+		const int64 lockedBytes = totalLockedBytes.get();
+
+		if(lockedBytes + (int64)size > memoryBudget) return;
+
+		if(totalLockedBytes.compareAndSetBool(lockedBytes + (int64)size, lockedBytes)) break;
+	}
+
+#if JUCE_LINUX
+	// Transparent huge pages need 2MB aligned regions, so the advice only covers the aligned part
+	const size_t hugePageSize = 2 * 1024 * 1024;
+	const size_t hugeStart = (start + hugePageSize - 1) & ~(hugePageSize - 1);
+	const size_t hugeEnd = end & ~(hugePageSize - 1);
+
+	if(hugeEnd > hugeStart) madvise((void*)hugeStart, hugeEnd - hugeStart, MADV_HUGEPAGE);
+#endif
+
+#if JUCE_WINDOWS
+	const bool success = VirtualLock((LPVOID)start, size) != 0;
+#else
+	const bool success = mlock((const void*)start, size) == 0;
+#endif
+
+	if(success)
+	{
+		lockedData = (void*)start;
+		numLockedBytes = size;
+	}
+	else
+	{
+		totalLockedBytes -= (int64)size;
+	}
+
+#else
+
+	ignoreUnused(data);
+	ignoreUnused(numBytes);
+
+#endif
+}
+
+ResidentMemoryLock::~ResidentMemoryLock()
+{
+#if LOCK_AUDIO_MEMORY
+
+	if(lockedData == nullptr) return;
+
+#if JUCE_WINDOWS
+	VirtualUnlock((LPVOID)lockedData, numLockedBytes);
+#else
+	munlock(lockedData, numLockedBytes);
+#endif
+
+	totalLockedBytes -= (int64)numLockedBytes;
+
+#endif
+}
+
+// ==================================================================================================== SharedPreloadMemory methods
+
+#if SHARED_PRELOAD_MEMORY_AVAILABLE
+
+// The header of a segment. The samples start at SHARED_PRELOAD_HEADER_SIZE bytes, so the channels stay aligned.
+struct SharedPreloadHeader
+{
+	uint32 magicNumber;
+	int32 numChannels;
+	int32 numSamples;
+	int32 isFilled;
+};
+
+#define SHARED_PRELOAD_HEADER_SIZE 64
+#define SHARED_PRELOAD_MAGIC_NUMBER 0x53535031
+
+/** Holds the creation lock of a segment while it is opened, checked or removed.
+*
+*	Nobody waits for another lock while holding it, so it is only held for a few system calls.
+*/
+struct SharedPreloadCreationLock
+{
+	SharedPreloadCreationLock(int handle_):
+		handle(handle_),
+		isLocked(handle_ != -1 && flock(handle_, LOCK_EX) == 0)
+	{};
+
+	~SharedPreloadCreationLock()
+	{
+		if(isLocked) flock(handle, LOCK_UN);
+	};
+
+	const int handle;
+	const bool isLocked;
+};
+
+#endif
+
+SharedPreloadMemory::SharedPreloadMemory(const String &key, int numChannels, int numSamples):
+	data(nullptr),
+	numBytes(0),
+	segmentHandle(-1),
+	lockHandle(-1),
+	creationLockHandle(-1),
+	isCreator(false)
+{
+	channels[0] = nullptr;
+	channels[1] = nullptr;
+
+#if SHARED_PRELOAD_MEMORY_AVAILABLE
+
+	jassert(numChannels <= 2);
+
+	// OSX only allows 31 characters for the name
+	const String hash = String::toHexString(key.hashCode64());
+
+	segmentName = "/ssp_" + hash;
+
+	const File tempDirectory = File::getSpecialLocation(File::tempDirectory);
+
+	lockHandle = open(tempDirectory.getChildFile("ssp_" + hash + ".lock").getFullPathName().toRawUTF8(), O_RDWR | O_CREAT, 0666);
+	creationLockHandle = open(tempDirectory.getChildFile("ssp_" + hash + ".create").getFullPathName().toRawUTF8(), O_RDWR | O_CREAT, 0666);
+
+	if(lockHandle == -1 || creationLockHandle == -1) return;
+
+	const SharedPreloadCreationLock creationLock(creationLockHandle);
+
+	if( ! creationLock.isLocked) return;
+
+	segmentHandle = shm_open(segmentName.toRawUTF8(), O_RDWR | O_CREAT, 0666);
+
+	if(segmentHandle == -1) return;
+
+	struct stat segmentInfo;
+
+	if(fstat(segmentHandle, &segmentInfo) != 0) return;
+
+	const size_t wantedBytes = SHARED_PRELOAD_HEADER_SIZE + (size_t)numChannels * (size_t)numSamples * sizeof(float);
+
+	const bool isNewSegment = segmentInfo.st_size == 0;
+
+	// Another format with the same hash
+	if( ! isNewSegment && (size_t)segmentInfo.st_size != wantedBytes) return;
+
+	if(isNewSegment && ftruncate(segmentHandle, (off_t)wantedBytes) != 0) return;
+
+	// The exclusive lock is only tried without blocking: if it fails, another object holds the shared lock of a user. 
+	// Every exclusive attempt happens under the creation lock, so the conversion to the shared lock below is safe.
+	const bool hasOtherUsers = flock(lockHandle, LOCK_EX | LOCK_NB) != 0;
+
+	void *mappedData = mmap(nullptr, wantedBytes, PROT_READ | PROT_WRITE, MAP_SHARED, segmentHandle, 0);
+
+	if(mappedData == MAP_FAILED) return;
+
+	SharedPreloadHeader *header = static_cast<SharedPreloadHeader*>(mappedData);
+
+	const bool isFilled = ! isNewSegment && header->isFilled != 0;
+
+	if(isFilled && (header->magicNumber != SHARED_PRELOAD_MAGIC_NUMBER || header->numChannels != numChannels || header->numSamples != numSamples))
+	{
+		munmap(mappedData, wantedBytes);
+		return;
+	}
+
+	if( ! isFilled && hasOtherUsers)
+	{
+		// Another user is still filling the segment, so this object uses private memory instead of waiting
+		munmap(mappedData, wantedBytes);
+		return;
+	}
+
+	if(isFilled)
+	{
+		mprotect(mappedData, wantedBytes, PROT_READ);
+	}
+	else
+	{
+		// The segment is new (or the process that created it died before it was filled)
+		header->magicNumber = SHARED_PRELOAD_MAGIC_NUMBER;
+		header->numChannels = numChannels;
+		header->numSamples = numSamples;
+		header->isFilled = 0;
+
+		isCreator = true;
+	}
+
+	flock(lockHandle, LOCK_SH);
+
+	data = mappedData;
+	numBytes = wantedBytes;
+
+	for(int i = 0; i < numChannels; i++)
+	{
+		channels[i] = reinterpret_cast<float*>(static_cast<char*>(mappedData) + SHARED_PRELOAD_HEADER_SIZE) + (size_t)i * (size_t)numSamples;
+	}
+
+#else
+
+	ignoreUnused(key);
+	ignoreUnused(numChannels);
+	ignoreUnused(numSamples);
+
+#endif
+}
+
+SharedPreloadMemory::~SharedPreloadMemory()
+{
+#if SHARED_PRELOAD_MEMORY_AVAILABLE
+
+	if(data != nullptr) munmap(data, numBytes);
+
+	if(segmentHandle != -1)
+	{
+		close(segmentHandle);
+
+		const SharedPreloadCreationLock creationLock(creationLockHandle);
+
+		// If no other object holds a shared lock, this was the last user of the segment
+		if(creationLock.isLocked && flock(lockHandle, LOCK_EX | LOCK_NB) == 0) shm_unlink(segmentName.toRawUTF8());
+	}
+
+	if(lockHandle != -1) close(lockHandle);
+	if(creationLockHandle != -1) close(creationLockHandle);
+
+#endif
+}
+
+void SharedPreloadMemory::markAsFilled()
+{
+#if SHARED_PRELOAD_MEMORY_AVAILABLE
+
+	if( ! isCreator) return;
+
+	{
+		// The other users check the flag under the creation lock
+		const SharedPreloadCreationLock creationLock(creationLockHandle);
+
+		static_cast<SharedPreloadHeader*>(data)->isFilled = 1;
+	}
+
+	mprotect(data, numBytes, PROT_READ);
+
+	isCreator = false;
+
+#endif
+}
+
+// ==================================================================================================== SIMD kernel selection
+
+// The SIMD kernels (PCM decoding and voice rendering) are compiled for their instruction set with a target attribute, 
+// so the rest of the code doesn't need AVX2. The kernels are selected once for the CPU (see getSimdKernelTable()).
+#if JUCE_INTEL && (JUCE_MSVC || defined(__GNUC__))
+#define SIMD_X86 1
+#else
+#define SIMD_X86 0
+#endif
+
+#if ! SIMD_X86 && (defined(__ARM_NEON__) || defined(__ARM_NEON))
+#define SIMD_NEON 1
+#else
+#define SIMD_NEON 0
+#endif
+
+#if SIMD_X86 && ! JUCE_MSVC
+#define SIMD_TARGET(instructionSet) __attribute__((target(instructionSet)))
+#else
+#define SIMD_TARGET(instructionSet)
+#endif
+
+typedef StreamingSamplerVoice::BatchLane BatchLane;
+
+typedef void (*RenderLanesFunction)(const BatchLane *lanes, int numLanes, float *outL, float *outR, int numSamples);
+
+// The batch render kernels are defined with the StreamingSampler methods, but they are selected with the decoders
+static void renderLanesScalar(const BatchLane *lanes, int numLanes, float *outL, float *outR, int numSamples);
+
+#if SIMD_X86 && VOICE_BATCH_SIZE == 8
+static void renderBatchAVX(const BatchLane *lanes, int numLanes, float *outL, float *outR, int numSamples);
+#endif
+
+// ==================================================================================================== PcmDecoder methods
+
+typedef void (*PcmDecodeFunction)(const uint8 *source, float *destL, float *destR, int numFrames);
+
+/** Converts a single sample with the same scaling as AudioData (1.0 is one step above the maximum value). */
+template <int format> static float decodePcmSample(const uint8 *data) noexcept
+{
+	if(format == PcmDecoder::Int16)	return (float)(int16)ByteOrder::littleEndianShort(data) * (1.0f / 32768.0f);
+	if(format == PcmDecoder::Int24)	return (float)ByteOrder::littleEndian24Bit((const char*)data) * (1.0f / 8388608.0f);
+	if(format == PcmDecoder::Int32)	return (float)(int32)ByteOrder::littleEndianInt(data) * (1.0f / 2147483648.0f);
+
+	const uint32 bits = ByteOrder::littleEndianInt(data);
+	float value;
+	memcpy(&value, &bits, sizeof(float));
+	return value;
+}
+
+template <int format, int numChannels> static void decodePcmScalar(const uint8 *source, float *destL, float *destR, int numFrames)
+{
+	const int frameSize = PcmDecoder::getBytesPerSample((PcmDecoder::Format)format) * numChannels;
+
+	for(int i = 0; i < numFrames; i++)
+	{
+		const uint8 *frame = source + i * frameSize;
+
+		destL[i] = decodePcmSample<format>(frame);
+		destR[i] = numChannels == 2 ? decodePcmSample<format>(frame + frameSize / 2) : destL[i];
+	}
+}
+
+#if SIMD_X86
+
+/** Loads eight samples and converts them to float (the integer formats are shifted to the top of a 32 bit integer). */
+template <int format> SIMD_TARGET("sse4.1") static inline void loadEightSamplesSSE(const uint8 *data, __m128 &a, __m128 &b)
+{
+	if(format == PcmDecoder::Float32)
+	{
+		a = _mm_loadu_ps((const float*)data);
+		b = _mm_loadu_ps((const float*)data + 4);
+		return;
+	}
+
+	__m128i ia, ib;
+
+	if(format == PcmDecoder::Int16)
+	{
+		const __m128i samples = _mm_loadu_si128((const __m128i*)data);
+
+		ia = _mm_slli_epi32(_mm_cvtepi16_epi32(samples), 16);
+		ib = _mm_slli_epi32(_mm_cvtepi16_epi32(_mm_srli_si128(samples, 8)), 16);
+	}
+	else if(format == PcmDecoder::Int24)
+	{
+		// The 24 bytes are loaded with two overlapping loads, so nothing after the last sample is read
+		const __m128i shuffleFirst = _mm_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+		const __m128i shuffleSecond = _mm_setr_epi8(-1, 4, 5, 6, -1, 7, 8, 9, -1, 10, 11, 12, -1, 13, 14, 15);
+
+		ia = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)data), shuffleFirst);
+		ib = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 8)), shuffleSecond);
+	}
+	else
+	{
+		ia = _mm_loadu_si128((const __m128i*)data);
+		ib = _mm_loadu_si128((const __m128i*)data + 1);
+	}
+
+	const __m128 scale = _mm_set1_ps(1.0f / 2147483648.0f);
+
+	a = _mm_mul_ps(_mm_cvtepi32_ps(ia), scale);
+	b = _mm_mul_ps(_mm_cvtepi32_ps(ib), scale);
+}
+
+template <int format, int numChannels> SIMD_TARGET("sse4.1") static void decodePcmSSE(const uint8 *source, float *destL, float *destR, int numFrames)
+{
+	const int frameSize = PcmDecoder::getBytesPerSample((PcmDecoder::Format)format) * numChannels;
+	const int framesPerStep = 8 / numChannels;
+
+	int i = 0;
+
+	for(; i + framesPerStep <= numFrames; i += framesPerStep)
+	{
+		__m128 a, b;
+
+		loadEightSamplesSSE<format>(source + i * frameSize, a, b);
+
+		if(numChannels == 2)
+		{
+			_mm_storeu_ps(destL + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+			_mm_storeu_ps(destR + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+		}
+		else
+		{
+			_mm_storeu_ps(destL + i, a);
+			_mm_storeu_ps(destL + i + 4, b);
+			_mm_storeu_ps(destR + i, a);
+			_mm_storeu_ps(destR + i + 4, b);
+		}
+	}
+
+	decodePcmScalar<format, numChannels>(source + i * frameSize, destL + i, destR + i, numFrames - i);
+}
+
+/** Loads sixteen samples and converts them to float. */
+template <int format> SIMD_TARGET("avx2") static inline void loadSixteenSamplesAVX(const uint8 *data, __m256 &a, __m256 &b)
+{
+	if(format == PcmDecoder::Float32)
+	{
+		a = _mm256_loadu_ps((const float*)data);
+		b = _mm256_loadu_ps((const float*)data + 8);
+		return;
+	}
+
+	__m256i ia, ib;
+
+	if(format == PcmDecoder::Int16)
+	{
+		ia = _mm256_slli_epi32(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)data)), 16);
+		ib = _mm256_slli_epi32(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)data + 1)), 16);
+	}
+	else if(format == PcmDecoder::Int24)
+	{
+		// Every 128 bit lane converts four samples. The loads overlap, so nothing after the last sample (byte 47) is read
+		const __m256i shuffleFirst = _mm256_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11,
+													  -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+		const __m256i shuffleSecond = _mm256_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11,
+													   -1, 4, 5, 6, -1, 7, 8, 9, -1, 10, 11, 12, -1, 13, 14, 15);
+
+		const __m256i first = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)data)), 
+													  _mm_loadu_si128((const __m128i*)(data + 12)), 1);
+		const __m256i second = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(data + 24))), 
+													   _mm_loadu_si128((const __m128i*)(data + 32)), 1);
+
+		ia = _mm256_shuffle_epi8(first, shuffleFirst);
+		ib = _mm256_shuffle_epi8(second, shuffleSecond);
+	}
+	else
+	{
+		ia = _mm256_loadu_si256((const __m256i*)data);
+		ib = _mm256_loadu_si256((const __m256i*)data + 1);
+	}
+
+	const __m256 scale = _mm256_set1_ps(1.0f / 2147483648.0f);
+
+	a = _mm256_mul_ps(_mm256_cvtepi32_ps(ia), scale);
+	b = _mm256_mul_ps(_mm256_cvtepi32_ps(ib), scale);
+}
+
+template <int format, int numChannels> SIMD_TARGET("avx2") static void decodePcmAVX(const uint8 *source, float *destL, float *destR, int numFrames)
+{
+	const int frameSize = PcmDecoder::getBytesPerSample((PcmDecoder::Format)format) * numChannels;
+	const int framesPerStep = 16 / numChannels;
+
+	int i = 0;
+
+	for(; i + framesPerStep <= numFrames; i += framesPerStep)
+	{
+		__m256 a, b;
+
+		loadSixteenSamplesAVX<format>(source + i * frameSize, a, b);
+
+		if(numChannels == 2)
+		{
+			// The shuffle works within the 128 bit lanes, so the 64 bit pairs must be sorted afterwards
+			const __m256 left = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+			const __m256 right = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+
+			_mm256_storeu_ps(destL + i, _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(left), _MM_SHUFFLE(3, 1, 2, 0))));
+			_mm256_storeu_ps(destR + i, _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(right), _MM_SHUFFLE(3, 1, 2, 0))));
+		}
+		else
+		{
+			_mm256_storeu_ps(destL + i, a);
+			_mm256_storeu_ps(destL + i + 8, b);
+			_mm256_storeu_ps(destR + i, a);
+			_mm256_storeu_ps(destR + i + 8, b);
+		}
+	}
+
+	decodePcmScalar<format, numChannels>(source + i * frameSize, destL + i, destR + i, numFrames - i);
+}
+
+/** Checks the CPU (and for AVX2 also the OS support for the registers). */
+static void getSupportedInstructionSets(bool &hasSSE41, bool &hasAVX2)
+{
+#if JUCE_MSVC
+	int info[4];
+
+	__cpuid(info, 0);
+	const int maxLevel = info[0];
+
+	__cpuid(info, 1);
+	hasSSE41 = (info[2] & (1 << 19)) != 0;
+
+	const bool osSavesAVXRegisters = (info[2] & (1 << 27)) != 0 && (info[2] & (1 << 28)) != 0 && (_xgetbv(0) & 6) == 6;
+
+	hasAVX2 = false;
+
+	if(maxLevel >= 7 && osSavesAVXRegisters)
+	{
+		__cpuidex(info, 7, 0);
+		hasAVX2 = (info[1] & (1 << 5)) != 0;
+	}
+#else
+	__builtin_cpu_init();
+
+	hasSSE41 = __builtin_cpu_supports("sse4.1") != 0;
+	hasAVX2 = __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+
+#elif SIMD_NEON
+
+template <int format, int numChannels> static void decodePcmNEON(const uint8 *source, float *destL, float *destR, int numFrames)
+{
+	const int frameSize = PcmDecoder::getBytesPerSample((PcmDecoder::Format)format) * numChannels;
+
+	// There is no NEON load for packed 24 bit samples
+	if(format == PcmDecoder::Int24)
+	{
+		decodePcmScalar<format, numChannels>(source, destL, destR, numFrames);
+		return;
+	}
+
+	const int framesPerStep = 8;
+
+	int i = 0;
+
+	for(; i + framesPerStep <= numFrames; i += framesPerStep)
+	{
+		const uint8 *data = source + i * frameSize;
+
+		float32x4_t l[2], r[2];
+
+		if(format == PcmDecoder::Int16)
+		{
+			const float32x4_t scale = vdupq_n_f32(1.0f / 32768.0f);
+
+			int16x8_t left, right;
+
+			if(numChannels == 2)
+			{
+				const int16x8x2_t frames = vld2q_s16((const int16_t*)data);
+				left = frames.val[0];
+				right = frames.val[1];
+			}
+			else
+			{
+				left = right = vld1q_s16((const int16_t*)data);
+			}
+
+			l[0] = vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(left))), scale);
+			l[1] = vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(left))), scale);
+			r[0] = vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(right))), scale);
+			r[1] = vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(right))), scale);
+		}
+		else
+		{
+			for(int j = 0; j < 2; j++)
+			{
+				const uint8 *part = data + j * 4 * frameSize;
+
+				if(format == PcmDecoder::Float32)
+				{
+					if(numChannels == 2)
+					{
+						const float32x4x2_t frames = vld2q_f32((const float*)part);
+						l[j] = frames.val[0];
+						r[j] = frames.val[1];
+					}
+					else
+					{
+						l[j] = r[j] = vld1q_f32((const float*)part);
+					}
+				}
+				else
+				{
+					const float32x4_t scale = vdupq_n_f32(1.0f / 2147483648.0f);
+
+					if(numChannels == 2)
+					{
+						const int32x4x2_t frames = vld2q_s32((const int32_t*)part);
+						l[j] = vmulq_f32(vcvtq_f32_s32(frames.val[0]), scale);
+						r[j] = vmulq_f32(vcvtq_f32_s32(frames.val[1]), scale);
+					}
+					else
+					{
+						l[j] = r[j] = vmulq_f32(vcvtq_f32_s32(vld1q_s32((const int32_t*)part)), scale);
+					}
+				}
+			}
+		}
+
+		vst1q_f32(destL + i, l[0]);
+		vst1q_f32(destL + i + 4, l[1]);
+		vst1q_f32(destR + i, r[0]);
+		vst1q_f32(destR + i + 4, r[1]);
+	}
+
+	decodePcmScalar<format, numChannels>(source + i * frameSize, destL + i, destR + i, numFrames - i);
+}
+
+#endif
+
+/** The decoders for every format and channel amount and the batch render kernel. They are selected once for the CPU. */
+struct SimdKernelTable
+{
+	void initialise() noexcept
+	{
+		instructionSetName = "Scalar";
+		renderLanes = renderLanesScalar;
+		setKernels<decodePcmScalar<PcmDecoder::Int16, 1>, decodePcmScalar<PcmDecoder::Int16, 2>,
+				   decodePcmScalar<PcmDecoder::Int24, 1>, decodePcmScalar<PcmDecoder::Int24, 2>,
+				   decodePcmScalar<PcmDecoder::Int32, 1>, decodePcmScalar<PcmDecoder::Int32, 2>,
+				   decodePcmScalar<PcmDecoder::Float32, 1>, decodePcmScalar<PcmDecoder::Float32, 2> >();
+
+#if SIMD_X86
+		bool hasSSE41, hasAVX2;
+		getSupportedInstructionSets(hasSSE41, hasAVX2);
+
+		if(hasAVX2)
+		{
+			instructionSetName = "AVX2";
+
+#if VOICE_BATCH_SIZE == 8
+			renderLanes = renderBatchAVX;
+#endif
+
+			setKernels<decodePcmAVX<PcmDecoder::Int16, 1>, decodePcmAVX<PcmDecoder::Int16, 2>,
+					   decodePcmAVX<PcmDecoder::Int24, 1>, decodePcmAVX<PcmDecoder::Int24, 2>,
+					   decodePcmAVX<PcmDecoder::Int32, 1>, decodePcmAVX<PcmDecoder::Int32, 2>,
+					   decodePcmAVX<PcmDecoder::Float32, 1>, decodePcmAVX<PcmDecoder::Float32, 2> >();
+		}
+		else if(hasSSE41)
+		{
+			instructionSetName = "SSE4.1";
+			setKernels<decodePcmSSE<PcmDecoder::Int16, 1>, decodePcmSSE<PcmDecoder::Int16, 2>,
+					   decodePcmSSE<PcmDecoder::Int24, 1>, decodePcmSSE<PcmDecoder::Int24, 2>,
+					   decodePcmSSE<PcmDecoder::Int32, 1>, decodePcmSSE<PcmDecoder::Int32, 2>,
+					   decodePcmSSE<PcmDecoder::Float32, 1>, decodePcmSSE<PcmDecoder::Float32, 2> >();
+		}
+#elif SIMD_NEON
+		instructionSetName = "NEON";
+		setKernels<decodePcmNEON<PcmDecoder::Int16, 1>, decodePcmNEON<PcmDecoder::Int16, 2>,
+				   decodePcmNEON<PcmDecoder::Int24, 1>, decodePcmNEON<PcmDecoder::Int24, 2>,
+				   decodePcmNEON<PcmDecoder::Int32, 1>, decodePcmNEON<PcmDecoder::Int32, 2>,
+				   decodePcmNEON<PcmDecoder::Float32, 1>, decodePcmNEON<PcmDecoder::Float32, 2> >();
+#endif
+	};
+
+	template <PcmDecodeFunction int16Mono, PcmDecodeFunction int16Stereo, PcmDecodeFunction int24Mono, PcmDecodeFunction int24Stereo,
+			  PcmDecodeFunction int32Mono, PcmDecodeFunction int32Stereo, PcmDecodeFunction floatMono, PcmDecodeFunction floatStereo>
+	void setKernels() noexcept
+	{
+		kernels[PcmDecoder::Int16][0] = int16Mono;
+		kernels[PcmDecoder::Int16][1] = int16Stereo;
+		kernels[PcmDecoder::Int24][0] = int24Mono;
+		kernels[PcmDecoder::Int24][1] = int24Stereo;
+		kernels[PcmDecoder::Int32][0] = int32Mono;
+		kernels[PcmDecoder::Int32][1] = int32Stereo;
+		kernels[PcmDecoder::Float32][0] = floatMono;
+		kernels[PcmDecoder::Float32][1] = floatStereo;
+	};
+
+	PcmDecodeFunction kernels[PcmDecoder::numFormats][2];
+	RenderLanesFunction renderLanes;
+	const char *instructionSetName;
+};
+
+// The table is a POD, so it is zero initialised before any code runs. Function-local statics are not initialised thread-safely 
+// by VS2012, so the first caller fills the table explicitly while the others wait.
+static SimdKernelTable simdKernelTable;
+static Atomic<int> simdKernelTableState;
+
+static const SimdKernelTable &getSimdKernelTable() noexcept
+{
+	enum { uninitialised = 0, initialising, initialised };
+
+	if(simdKernelTableState.get() != initialised)
+	{
+		if(simdKernelTableState.compareAndSetBool(initialising, uninitialised))
+		{
+			simdKernelTable.initialise();
+			simdKernelTableState.set(initialised);
+		}
+		else
+		{
+			while(simdKernelTableState.get() != initialised) Thread::yield();
+		}
+	}
+
+	return simdKernelTable;
+}
+
+PcmDecoder::Format PcmDecoder::getFormat(const AudioFormatReader &reader) noexcept
+{
+	if(reader.numChannels < 1 || reader.numChannels > 2) return Unsupported;
+
+	if(reader.usesFloatingPointData) return reader.bitsPerSample == 32 ? Float32 : Unsupported;
+
+	switch(reader.bitsPerSample)
+	{
+	case 16:	return Int16;
+	case 24:	return Int24;
+	case 32:	return Int32;
+	default:	return Unsupported;
+	}
+}
+
+void PcmDecoder::decode(Format format, int numChannels, const void *source, float *destL, float *destR, int numFrames) noexcept
+{
+	jassert(format != Unsupported && (numChannels == 1 || numChannels == 2));
+
+	getSimdKernelTable().kernels[format][numChannels - 1](static_cast<const uint8*>(source), destL, destR, numFrames);
+}
+
+const char *PcmDecoder::getInstructionSetName() noexcept
+{
+	return getSimdKernelTable().instructionSetName;
+}
+
 // ==================================================================================================== StreamingSamplerSound methods
 
-StreamingSamplerSound::StreamingSamplerSound(const File &fileToLoad, 
-											 BigInteger midiNotes_, 
-											 int midiNoteForNormalPitch):
-	fileName(fileToLoad.getFullPathName()),
-	midiNotes(midiNotes_),
-	rootNote(midiNoteForNormalPitch)
+/** MemoryMappedAudioFormatReader::sampleToPointer() is protected, but a member pointer taken in a subclass can be used on any reader. */
+struct MappedSampleAccess: public MemoryMappedAudioFormatReader
+{
+	static const void *getPointer(const MemoryMappedAudioFormatReader &reader, int64 sample) noexcept
+	{
+		return (reader.*(&MappedSampleAccess::sampleToPointer))(sample);
+	};
+};
+
+StreamingSamplerSound::StreamingSamplerSound(const File &fileToLoad, 
+											 BigInteger midiNotes_, 
+											 int midiNoteForNormalPitch):
+	StreamingSoundMapping(midiNotes_, midiNoteForNormalPitch),
+	fileName(fileToLoad.getFullPathName()),
+	decoderFormat(PcmDecoder::Unsupported),
+	preloadSize(PRELOAD_SIZE),
+	releaseTimeMs(DEFAULT_RELEASE_TIME_MS),
+	loopStart(0),
+	loopEnd(0),
+	loopCrossfade(DEFAULT_LOOP_CROSSFADE_LENGTH),
+	velocityStartOffset(0),
+	readLatency(-1.0),
+	observedPlaybackRate(1.0),
+	mappedPlaybackRate(0.0)
+{
+	mapFile(fileToLoad);
+
+	const StringPairArray &metadata = memoryReader->metadataValues;
+
+	if(metadata.containsKey("Loop0Start") && metadata.containsKey("Loop0End"))
+	{
+		// The end of a smpl loop is the last sample of the loop
+		applyLoopPoints(metadata.getValue("Loop0Start", "0").getLargeIntValue(),
+						metadata.getValue("Loop0End", "0").getLargeIntValue() + 1, 
+						DEFAULT_LOOP_CROSSFADE_LENGTH);
+	}
+
+	setPreloadSize(PRELOAD_SIZE);
+}
+
+StreamingSamplerSound::StreamingSamplerSound(const File &versionFile, const StreamingSamplerSound &parent, int octave):
+	// The root note is shifted by the octave, so the pitch factors of the version already include the lower sample rate
+	StreamingSoundMapping(parent.midiNotes, parent.rootNote + 12 * octave),
+	fileName(versionFile.getFullPathName()),
+	decoderFormat(PcmDecoder::Unsupported),
+	preloadSize(PRELOAD_SIZE),
+	releaseTimeMs(parent.releaseTimeMs),
+	loopStart(0),
+	loopEnd(0),
+	loopCrossfade(DEFAULT_LOOP_CROSSFADE_LENGTH),
+	velocityStartOffset(0),
+	readLatency(-1.0),
+	observedPlaybackRate(1.0),
+	mappedPlaybackRate(0.0)
+{
+	mapFile(versionFile);
+
+	// The version is set up completely before its preload buffers are filled (only once)
+	if(parent.isLoopEnabled()) applyLoopPoints(parent.loopStart >> octave, parent.loopEnd >> octave, parent.loopCrossfade >> octave);
+
+	Array<int64> versionAnchors;
+
+	for(int i = 0; i < parent.startAnchors.size(); i++) versionAnchors.add(parent.startAnchors[i] >> octave);
+
+	applyStartAnchors(versionAnchors);
+
+	setPreloadSize(parent.isEntirelyLoaded() ? -1 : parent.preloadSize);
+}
+
+void StreamingSamplerSound::mapFile(const File &fileToLoad)
+{
+	WavAudioFormat waf;
+	memoryReader = waf.createMemoryMappedReader(fileToLoad);
+	
+	if(memoryReader != nullptr) memoryReader->mapEntireFile();
+
+	else throw LoadingError(fileName, "file does not exist");
+	
+	if(memoryReader->getMappedSection().isEmpty()) throw LoadingError(fileName, "Error at memory mapping");
+
+	sampleRate = memoryReader->sampleRate;
+
+	decoderFormat = PcmDecoder::getFormat(*memoryReader);
+
+#if ZERO_COPY_STREAMING_AVAILABLE
+
+	// The voices read these samples later in the audio thread, so they must stay resident (if the lock fails, they are copied)
+	if(memoryReader->usesFloatingPointData && memoryReader->bitsPerSample == 32 && memoryReader->numChannels == 2)
+	{
+		const Range<int64> mappedSection = memoryReader->getMappedSection();
+
+		const void *firstSample = MappedSampleAccess::getPointer(*memoryReader, mappedSection.getStart());
+
+		mappedFileLock = new ResidentMemoryLock(firstSample, (size_t)mappedSection.getLength() * 2 * sizeof(float));
+	}
+
+#endif
+}
+
+void StreamingSamplerSound::setPreloadSize(int newPreloadSize)
+{
+	fillPreloadBuffers(newPreloadSize, false);
+}
+
+void StreamingSamplerSound::fillPreloadBuffers(int newPreloadSize, bool refillOctaveVersions)
+{
+	ScopedLock sl(reconfigurationLock);
+
+	int newSize = newPreloadSize;
+
+	int64 maxSize = memoryReader->getMappedSection().getLength();
+
+	if(newPreloadSize == -1 || newSize > maxSize)
+	{
+		newSize = (int)maxSize;
+	};
+
+	PreloadData::Ptr newPreload;
+
+	try
+	{
+		newPreload = new PreloadData(newSize, createSharedPreloadMemory(0, newSize));
+	}
+	catch(std::bad_alloc memoryExeption)
+	{
+		throw LoadingError(fileName, "out of Memory!");
+	}
+
+	// If the sound is looped, the loop is unrolled into the preload buffer
+	newPreload->loop = currentLoop;
+	newPreload->containsEntireSample = newSize >= maxSize && currentLoop == nullptr;
+
+	fillPreloadBuffer(newPreload->buffer, newSize, 0);
+
+	// Every start anchor gets its own preload buffer (unless the entire sample is already in memory)
+	if(newSize < maxSize)
+	{
+		for(int i = 0; i < startAnchors.size(); i++)
+		{
+			ResidentSampleBuffer *anchorBuffer;
+
+			try
+			{
+				anchorBuffer = new ResidentSampleBuffer(2, newSize, createSharedPreloadMemory(startAnchors[i], newSize));
+			}
+			catch(std::bad_alloc memoryExeption)
+			{
+				throw LoadingError(fileName, "out of Memory!");
+			}
+
+			newPreload->anchorBuffers.add(anchorBuffer);
+			newPreload->anchorPositions.add(startAnchors[i]);
+
+			fillPreloadBuffer(*anchorBuffer, newSize, startAnchors[i]);
+		}
+	}
+
+	PreloadData::Ptr oldPreload;
+
+	{
+		SpinLock::ScopedLockType spl(preloadLock);
+
+		oldPreload = currentPreload;
+		currentPreload = newPreload;
+		preloadSize = newSize;
+	}
+
+	// Voices that are still playing keep a reference to the old buffer, so it can't be deleted yet.
+	if(oldPreload != nullptr) retiredPreloads.add(oldPreload);
+
+	releaseUnusedPreloadBuffers();
+
+	for(int i = 0; i < octaveVersions.size(); i++)
+	{
+		StreamingSamplerSound *version = octaveVersions.getUnchecked(i);
+
+		// The version clamps the size to its own length, so the clamped sizes must be compared
+		const int64 versionLength = version->getSampleLength();
+		const int clampedSize = (int)(newPreloadSize == -1 ? versionLength : jmin((int64)newPreloadSize, versionLength));
+
+		const bool needsUpdate = refillOctaveVersions || version->getPreloadSize() != clampedSize;
+
+		if(needsUpdate) version->fillPreloadBuffers(newPreloadSize, false);
+	}
+}
+
+int StreamingSamplerSound::getNumPreloadBuffers() const
+{
+	ScopedLock sl(reconfigurationLock);
+
+	int numBuffers = getPreloadData()->getNumAnchors();
+
+	for(int i = 0; i < octaveVersions.size(); i++) numBuffers += octaveVersions.getUnchecked(i)->getNumPreloadBuffers();
+
+	return numBuffers;
+}
+
+size_t StreamingSamplerSound::getLoopMemoryUsage() const
+{
+	ScopedLock sl(reconfigurationLock);
+
+	const int64 loopSize = isLoopEnabled() ? loopEnd - loopStart : 0;
+
+	size_t loopMemory = (size_t)(loopSize * 2) * sizeof(float);
+
+	for(int i = 0; i < octaveVersions.size(); i++) loopMemory += octaveVersions.getUnchecked(i)->getLoopMemoryUsage();
+
+	return loopMemory;
+}
+
+size_t StreamingSamplerSound::getNumLockedFileBytes() const
+{
+	ScopedLock sl(reconfigurationLock);
+
+	size_t lockedBytes = mappedFileLock != nullptr ? mappedFileLock->getNumLockedBytes() : 0;
+
+	for(int i = 0; i < octaveVersions.size(); i++) lockedBytes += octaveVersions.getUnchecked(i)->getNumLockedFileBytes();
+
+	return lockedBytes;
+}
+
+SharedPreloadMemory *StreamingSamplerSound::createSharedPreloadMemory(int64 streamPosition, int numSamples) const
+{
+#if SHARED_PRELOAD_MEMORY_AVAILABLE
+
+	// The unrolled loop is part of the preloaded data, so the loop points belong to the key
+	const String key = fileName + "|" + String(File(fileName).getLastModificationTime().toMilliseconds())
+								+ "|float32x2|" + String(streamPosition) + "|" + String(numSamples)
+								+ "|" + String(currentLoop != nullptr ? loopStart : 0) + "|" + String(currentLoop != nullptr ? loopEnd : 0)
+								+ "|" + String(currentLoop != nullptr ? loopCrossfade : 0);
+
+	ScopedPointer<SharedPreloadMemory> sharedMemory = new SharedPreloadMemory(key, 2, numSamples);
+
+	return sharedMemory->isValid() ? sharedMemory.release() : nullptr;
+
+#else
+
+	ignoreUnused(streamPosition);
+	ignoreUnused(numSamples);
+
+	return nullptr;
+
+#endif
+}
+
+void StreamingSamplerSound::fillPreloadBuffer(ResidentSampleBuffer &buffer, int numSamples, int64 streamPosition) const
+{
+	// Another process already filled the shared segment
+	if( ! buffer.needsToBeFilled()) return;
+
+	readFromStream(buffer, numSamples, streamPosition, currentLoop);
+
+	buffer.markAsFilled();
+}
+
+void StreamingSamplerSound::releaseUnusedPreloadBuffers()
+{
+	ScopedLock sl(reconfigurationLock);
+
+	for(int i = retiredPreloads.size() - 1; i >= 0; i--)
+	{
+		// If the retired array holds the only reference, no SampleLoader can use it anymore
+		if(retiredPreloads[i]->getReferenceCount() == 1) retiredPreloads.remove(i);
+	}
+
+	for(int i = 0; i < octaveVersions.size(); i++) octaveVersions.getUnchecked(i)->releaseUnusedPreloadBuffers();
+}
+
+size_t StreamingSamplerSound::getRetiredPreloadSize() const
+{
+	ScopedLock sl(reconfigurationLock);
+
+	size_t retiredSize = 0;
+
+	for(int i = 0; i < retiredPreloads.size(); i++) retiredSize += retiredPreloads[i]->getMemoryUsage();
+
+	return retiredSize;
+}
+
+void StreamingSamplerSound::setLoopPoints(int64 newLoopStart, int64 newLoopEnd, int crossfadeLength)
+{
+	ScopedLock sl(reconfigurationLock);
+
+	applyLoopPoints(newLoopStart, newLoopEnd, crossfadeLength);
+
+	// The octave versions have the same loop with a lower sample rate
+	for(int i = 0; i < octaveVersions.size(); i++)
+	{
+		const int octave = i + 1;
+
+		octaveVersions.getUnchecked(i)->applyLoopPoints(loopStart >> octave, loopEnd >> octave, loopCrossfade >> octave);
+	}
+
+	// The preload buffers contain the start of the loop, so they must be filled again (once for every version)
+	fillPreloadBuffers(preloadSize, true);
+}
+
+void StreamingSamplerSound::applyLoopPoints(int64 newLoopStart, int64 newLoopEnd, int crossfadeLength)
+{
+	ScopedLock sl(reconfigurationLock);
+
+	const int64 sampleLength = memoryReader->getMappedSection().getLength();
+
+	loopStart = jlimit<int64>(0, sampleLength, newLoopStart);
+	loopEnd = jlimit<int64>(0, sampleLength, newLoopEnd);
+	loopCrossfade = jmax(0, crossfadeLength);
+
+	currentLoop = createLoopData();
+}
+
+void StreamingSamplerSound::setStartAnchors(const Array<int64> &anchorPositions)
+{
+	ScopedLock sl(reconfigurationLock);
+
+	applyStartAnchors(anchorPositions);
+
+	for(int i = 0; i < octaveVersions.size(); i++)
+	{
+		const int octave = i + 1;
+
+		Array<int64> versionAnchors;
+
+		for(int j = 0; j < startAnchors.size(); j++) versionAnchors.add(startAnchors[j] >> octave);
+
+		octaveVersions.getUnchecked(i)->applyStartAnchors(versionAnchors);
+	}
+
+	fillPreloadBuffers(preloadSize, true);
+}
+
+void StreamingSamplerSound::applyStartAnchors(const Array<int64> &anchorPositions)
+{
+	ScopedLock sl(reconfigurationLock);
+
+	const int64 sampleLength = memoryReader->getMappedSection().getLength();
+
+	startAnchors.clear();
+
+	for(int i = 0; i < anchorPositions.size(); i++)
+	{
+		const int64 position = anchorPositions[i];
+
+		// The start of the sample is always the first anchor
+		if(position > 0 && position < sampleLength && ! startAnchors.contains(position)) startAnchors.addUsingDefaultSort(position);
+	}
+}
+
+void StreamingSamplerSound::createOctaveVersions(int numOctaves)
+{
+	ScopedLock sl(reconfigurationLock);
+
+	octaveVersions.clear();
+
+	const File sampleFile(fileName);
+
+	for(int octave = 1; octave <= jmin(numOctaves, MAX_OCTAVE_VERSIONS); octave++)
+	{
+		const File versionFile = sampleFile.getSiblingFile(sampleFile.getFileNameWithoutExtension() + "_oct" + String(octave) + ".wav");
+
+		// Every version is decimated from the previous one
+		const StreamingSamplerSound *source = octave == 1 ? this : octaveVersions.getUnchecked(octave - 2);
+
+		if( ! versionFile.existsAsFile() || 
+			versionFile.getLastModificationTime().toMilliseconds() < sampleFile.getLastModificationTime().toMilliseconds())
+		{
+			source->writeDecimatedVersion(versionFile);
+		}
+
+		// The version takes the loop points, the start anchors, the release time and the preload size of this sound
+		octaveVersions.add(new StreamingSamplerSound(versionFile, *this, octave));
+	}
+}
+
+void StreamingSamplerSound::writeDecimatedVersion(const File &targetFile) const
+{
+	// A windowed sinc low pass with the cutoff a bit below the new nyquist frequency
+	const int numTaps = 63;
+	const int halfLength = numTaps / 2;
+	const double cutoff = 0.225;
+
+	float coefficients[numTaps];
+	double sum = 0.0;
+
+	for(int i = 0; i < numTaps; i++)
+	{
+		const double x = (double)(i - halfLength);
+		const double sinc = x == 0.0 ? 2.0 * cutoff : sin(2.0 * double_Pi * cutoff * x) / (double_Pi * x);
+		const double window = 0.42 - 0.5 * cos(2.0 * double_Pi * i / (numTaps - 1)) + 0.08 * cos(4.0 * double_Pi * i / (numTaps - 1));
+
+		coefficients[i] = (float)(sinc * window);
+		sum += sinc * window;
+	}
+
+	for(int i = 0; i < numTaps; i++) coefficients[i] = (float)(coefficients[i] / sum);
+
+	// The file is written to a temporary file first, so a cancelled write never leaves a broken version
+	const File tempFile = targetFile.withFileExtension("tmp");
+
+	tempFile.deleteFile();
+
+	ScopedPointer<FileOutputStream> stream = tempFile.createOutputStream();
+
+	if(stream == nullptr || stream->failedToOpen()) throw LoadingError(targetFile.getFullPathName(), "can't write the octave version");
+
+	WavAudioFormat waf;
+
+	ScopedPointer<AudioFormatWriter> writer = waf.createWriterFor(stream, sampleRate * 0.5, 2, 32, StringPairArray(), 0);
+
+	if(writer == nullptr) throw LoadingError(targetFile.getFullPathName(), "can't write the octave version");
+
+	// The writer deletes the stream
+	stream.release();
+
+	const int blockSize = 32768;
+
+	const int64 sourceLength = getSampleLength();
+	const int64 targetLength = (sourceLength + 1) / 2;
+
+	AudioSampleBuffer input(2, 2 * blockSize + numTaps);
+	AudioSampleBuffer output(2, blockSize);
+
+	for(int64 outputStart = 0; outputStart < targetLength; outputStart += blockSize)
+	{
+		const int numOutput = (int)jmin<int64>(blockSize, targetLength - outputStart);
+		const int numInput = 2 * numOutput + numTaps;
+
+		// The filter is centered on every second sample, so the input starts half a filter length earlier
+		const int64 inputStart = 2 * outputStart - halfLength;
+		const int64 readStart = jmax<int64>(0, inputStart);
+		const int64 readEnd = jmin<int64>(sourceLength, inputStart + numInput);
+
+		input.clear();
+
+		if(readEnd > readStart) readFromFile(input, (int)(readStart - inputStart), (int)(readEnd - readStart), readStart);
+
+		for(int channel = 0; channel < 2; channel++)
+		{
+			const float *in = input.getReadPointer(channel);
+			float *out = output.getWritePointer(channel);
+
+			for(int i = 0; i < numOutput; i++)
+			{
+				const float *x = in + 2 * i;
+				float value = 0.0f;
+
+				for(int k = 0; k < numTaps; k++) value += coefficients[k] * x[k];
+
+				out[i] = value;
+			}
+		}
+
+		if( ! writer->writeFromAudioSampleBuffer(output, 0, numOutput))
+		{
+			throw LoadingError(targetFile.getFullPathName(), "can't write the octave version");
+		}
+	}
+
+	writer = nullptr;
+
+	if( ! tempFile.moveFileTo(targetFile)) throw LoadingError(targetFile.getFullPathName(), "can't write the octave version");
+}
+
+StreamingSamplerSound::LoopData::Ptr StreamingSamplerSound::createLoopData() const
+{
+	if( ! isLoopEnabled()) return nullptr;
+
+	const int loopLength = (int)(loopEnd - loopStart);
+
+	LoopData::Ptr newLoop;
+
+	try
+	{
+		newLoop = new LoopData(loopStart, loopLength);
+	}
+	catch(std::bad_alloc memoryExeption)
+	{
+		throw LoadingError(fileName, "out of Memory!");
+	}
+
+	readFromFile(newLoop->buffer, 0, loopLength, loopStart);
+
+	// The end of the loop is faded into the samples before the loop start, so the jump back to the loop start is seamless
+	const int fadeLength = (int)jmin<int64>((int64)loopCrossfade, loopStart, (int64)loopLength);
+
+	if(fadeLength > 0)
+	{
+		AudioSampleBuffer preLoopBuffer(2, fadeLength);
+
+		readFromFile(preLoopBuffer, 0, fadeLength, loopStart - fadeLength);
+
+		for(int channel = 0; channel < 2; channel++)
+		{
+			float *loopData = newLoop->buffer.getWritePointer(channel, loopLength - fadeLength);
+			const float *preLoopData = preLoopBuffer.getReadPointer(channel);
+
+			for(int i = 0; i < fadeLength; i++)
+			{
+				const float fadeIn = (float)(i + 1) / (float)fadeLength;
+
+				loopData[i] = loopData[i] * (1.0f - fadeIn) + preLoopData[i] * fadeIn;
+			}
+		}
+	}
+
+	return newLoop;
+}
+
+int StreamingSamplerSound::getRecommendedPreloadSize() const
+{
+	const double latency = getReadLatency();
+
+	if(latency < 0.0) return preloadSize;
+
+	const int recommendedSize = (int)(latency * STREAM_LATENCY_SAFETY_FACTOR * sampleRate * getMaximumPlaybackRate());
+
+	return jmax(recommendedSize, MIN_BUFFER_SIZE_FOR_STREAM_BUFFERS);
+}
+
+double StreamingSamplerSound::getMaximumPlaybackRate() const noexcept
+{
+	const double mappedRate = getMaximumPitchFactor();
+
+	SpinLock::ScopedLockType sl(latencyLock);
+
+	return jmax(mappedRate, mappedPlaybackRate, observedPlaybackRate);
+}
+
+void StreamingSamplerSound::reportMappedPlaybackRate(double playbackRate) noexcept
+{
+	SpinLock::ScopedLockType sl(latencyLock);
+
+	mappedPlaybackRate = jmax(mappedPlaybackRate, playbackRate);
+}
+
+void StreamingSamplerSound::reportReadLatency(double latencyInSeconds, double playbackRate) const
+{
+	SpinLock::ScopedLockType sl(latencyLock);
+
+	if(latencyInSeconds > readLatency)	readLatency = latencyInSeconds;
+	else								readLatency = 0.95 * readLatency + 0.05 * latencyInSeconds;
+
+	observedPlaybackRate = jmax(observedPlaybackRate, jmin(playbackRate, (double)MAX_SAMPLER_PITCH));
+}
+
+bool StreamingSamplerSound::hasEnoughSamplesForBlock(int64 maxSampleIndexInStream) const
+{
+	return isLoopEnabled() || maxSampleIndexInStream < memoryReader->getMappedSection().getEnd();
+}
+
+const float *StreamingSamplerSound::getResidentMappedSamples(int64 streamPosition, int numSamples, const PreloadData &data) const
+{
+#if ZERO_COPY_STREAMING_AVAILABLE
+
+	if( ! memoryReader->usesFloatingPointData || memoryReader->bitsPerSample != 32 || memoryReader->numChannels != 2) return nullptr;
+
+	// The samples after the loop start come from the loop buffer
+	if(data.loop != nullptr && streamPosition + numSamples > data.loop->loopStart) return nullptr;
+
+	if(streamPosition < 0 || ! memoryReader->getMappedSection().contains(Range<int64>(streamPosition, streamPosition + numSamples))) return nullptr;
+
+	const float *samples = static_cast<const float*>(MappedSampleAccess::getPointer(*memoryReader, streamPosition));
+
+	// A page that was resident now could be evicted before the audio thread reads the block, so only locked pages are used.
+	// The lock lasts as long as the sound, which outlives every voice that plays it.
+	if(mappedFileLock == nullptr || ! mappedFileLock->containsRange(samples, (size_t)numSamples * 2 * sizeof(float))) return nullptr;
+
+	return samples;
+
+#else
+
+	ignoreUnused(streamPosition);
+	ignoreUnused(numSamples);
+	ignoreUnused(data);
+
+	return nullptr;
+
+#endif
+}
+
+void StreamingSamplerSound::fillSampleBuffer(AudioSampleBuffer &sampleBuffer, int samplesToCopy, int64 uptime, const PreloadData &data) const
+{
+	if(uptime + samplesToCopy < data.buffer.getNumSamples())
+	{
+		FloatVectorOperations::copy(sampleBuffer.getWritePointer(0, 0), data.buffer.getReadPointer(0, (int)uptime), samplesToCopy);
+		FloatVectorOperations::copy(sampleBuffer.getWritePointer(1, 0), data.buffer.getReadPointer(1, (int)uptime), samplesToCopy);
+	}
+	else 
+	{
+		readFromStream(sampleBuffer, samplesToCopy, uptime, data.loop);
+	}
+};
+
+void StreamingSamplerSound::readFromStream(AudioSampleBuffer &sampleBuffer, int samplesToCopy, int64 streamPosition, const LoopData *loop) const
+{
+	// Without a loop, the file is read until its end
+	const int64 fileEnd = loop != nullptr ? loop->loopStart : memoryReader->getMappedSection().getEnd();
+
+	int offset = 0;
+
+	while(offset < samplesToCopy)
+	{
+		const int64 position = streamPosition + offset;
+		const int numLeft = samplesToCopy - offset;
+
+		if(loop != nullptr && position >= loop->loopStart)
+		{
+			// The loop is already in memory, so this doesn't touch the disk
+			const int loopPosition = loop->getLoopPosition(position);
+			const int numThisTime = jmin(numLeft, loop->buffer.getNumSamples() - loopPosition);
+
+			sampleBuffer.copyFrom(0, offset, loop->buffer, 0, loopPosition, numThisTime);
+			sampleBuffer.copyFrom(1, offset, loop->buffer, 1, loopPosition, numThisTime);
+
+			offset += numThisTime;
+		}
+		else
+		{
+			const int numThisTime = (int)jmin<int64>((int64)numLeft, fileEnd - position);
+
+			if(numThisTime <= 0)
+			{
+				// The last block of the sample is only partially filled, so the rest is cleared.
+				sampleBuffer.clear(offset, numLeft);
+				break;
+			}
+
+			readFromFile(sampleBuffer, offset, numThisTime, position);
+
+			offset += numThisTime;
+		}
+	}
+};
+
+void StreamingSamplerSound::readFromFile(AudioSampleBuffer &buffer, int startSample, int numSamples, int64 filePosition) const
+{
+	if(decoderFormat != PcmDecoder::Unsupported && 
+	   filePosition >= 0 && memoryReader->getMappedSection().contains(Range<int64>(filePosition, filePosition + numSamples)))
+	{
+		PcmDecoder::decode(decoderFormat, (int)memoryReader->numChannels, MappedSampleAccess::getPointer(*memoryReader, filePosition), 
+						   buffer.getWritePointer(0, startSample), buffer.getWritePointer(1, startSample), numSamples);
+	}
+	else
+	{
+		memoryReader->read(&buffer, startSample, numSamples, filePosition, true, true);
+	}
+}
+
+// ==================================================================================================== StreamingBufferPool methods
+
+StreamingBufferPool::StreamingBufferPool(int maxNumActiveVoices, int bufferSizeInSamples):
+	numSlots(maxNumActiveVoices),
+	numFreeSlots(maxNumActiveVoices),
+	bufferSize(bufferSizeInSamples)
+{
+	arena.calloc((size_t)numSlots * 2 * getSlotSizePerChannel());
+	arenaLock = new ResidentMemoryLock(arena, getMemoryUsage());
+	freeSlots.malloc((size_t)numSlots);
+
+	// The free slots are used as a stack, so the first slot will be acquired first
+	for(int i = 0; i < numSlots; i++) freeSlots[i] = numSlots - 1 - i;
+}
+
+int StreamingBufferPool::acquireSlot() noexcept
+{
+	SpinLock::ScopedLockType sl(lock);
+
+	if(numFreeSlots == 0) return -1;
+
+	return freeSlots[--numFreeSlots];
+}
+
+void StreamingBufferPool::releaseSlot(int slotIndex) noexcept
+{
+	SpinLock::ScopedLockType sl(lock);
+
+	jassert(isPositiveAndBelow(slotIndex, numSlots));
+	jassert(numFreeSlots < numSlots);
+
+	freeSlots[numFreeSlots++] = slotIndex;
+}
+
+// ==================================================================================================== WakeUpSemaphore methods
+
+WakeUpSemaphore::WakeUpSemaphore():
+	handle(nullptr)
+{
+#if JUCE_WINDOWS
+	handle = CreateSemaphore(nullptr, 0, 0x7fffffff, nullptr);
+#elif JUCE_MAC
+	semaphore_t *semaphore = new semaphore_t;
+
+	if(semaphore_create(mach_task_self(), semaphore, SYNC_POLICY_FIFO, 0) == KERN_SUCCESS)	handle = semaphore;
+	else																					delete semaphore;
+#else
+	sem_t *semaphore = new sem_t;
+
+	if(sem_init(semaphore, 0, 0) == 0)	handle = semaphore;
+	else								delete semaphore;
+#endif
+
+	jassert(handle != nullptr);
+}
+
+WakeUpSemaphore::~WakeUpSemaphore()
+{
+	if(handle == nullptr) return;
+
+#if JUCE_WINDOWS
+	CloseHandle((HANDLE)handle);
+#elif JUCE_MAC
+	semaphore_destroy(mach_task_self(), *(semaphore_t*)handle);
+	delete (semaphore_t*)handle;
+#else
+	sem_destroy((sem_t*)handle);
+	delete (sem_t*)handle;
+#endif
+}
+
+void WakeUpSemaphore::signal() noexcept
+{
+	if(handle == nullptr) return;
+
+#if JUCE_WINDOWS
+	ReleaseSemaphore((HANDLE)handle, 1, nullptr);
+#elif JUCE_MAC
+	semaphore_signal(*(semaphore_t*)handle);
+#else
+	sem_post((sem_t*)handle);
+#endif
+}
+
+bool WakeUpSemaphore::wait(int timeoutMilliseconds) noexcept
+{
+	if(handle == nullptr)
+	{
+		Thread::sleep(timeoutMilliseconds);
+		return false;
+	}
+
+#if JUCE_WINDOWS
+	return WaitForSingleObject((HANDLE)handle, (DWORD)timeoutMilliseconds) == WAIT_OBJECT_0;
+#elif JUCE_MAC
+	mach_timespec_t timeout = { (unsigned int)(timeoutMilliseconds / 1000), (clock_res_t)((timeoutMilliseconds % 1000) * 1000000) };
+
+	return semaphore_timedwait(*(semaphore_t*)handle, timeout) == KERN_SUCCESS;
+#else
+	// sem_timedwait() needs an absolute time
+	timespec timeout;
+	clock_gettime(CLOCK_REALTIME, &timeout);
+
+	timeout.tv_sec += timeoutMilliseconds / 1000;
+	timeout.tv_nsec += (long)(timeoutMilliseconds % 1000) * 1000000;
+
+	if(timeout.tv_nsec >= 1000000000)
+	{
+		timeout.tv_sec++;
+		timeout.tv_nsec -= 1000000000;
+	}
+
+	int result;
+
+	while((result = sem_timedwait((sem_t*)handle, &timeout)) != 0 && errno == EINTR) {}
+
+	return result == 0;
+#endif
+}
+
+// ==================================================================================================== StreamingThread methods
+
+StreamingThread::StreamingThread(int maxNumRequests):
+	Thread("StreamingThread"),
+	writePosition(0),
+	readPosition(0),
+	isWaiting(0)
+{
+	const int queueSize = nextPowerOfTwo(jmax(2, maxNumRequests));
+
+	mask = (uint32)queueSize - 1;
+
+	requests.calloc((size_t)queueSize);
+
+	for(int i = 0; i < queueSize; i++) requests[i].sequence.set((uint32)i);
+
+	startThread(8);
+}
+
+StreamingThread::~StreamingThread()
+{
+	// The thread waits on the semaphore, so it must be woken up to see the exit flag
+	signalThreadShouldExit();
+	wakeUp.signal();
+
+	stopThread(2000);
+}
+
+bool StreamingThread::addRequest(SampleLoader *loader) noexcept
+{
+	// A bounded multi producer queue: the producers reserve a slot by moving the write position, 
+	// the sequence of the slot tells if the consumer has already read the previous request.
+	uint32 position = writePosition.get();
+	Request *request;
+
+	for(;;)
+	{
+		request = &requests[(int)(position & mask)];
+
+		const int difference = (int)(request->sequence.get() - position);
+
+		if(difference == 0)
+		{
+			if(writePosition.compareAndSetBool(position + 1, position)) break;
+
+			position = writePosition.get();
+		}
+		else if(difference < 0)
+		{
+			// The queue is full
+			return false;
+		}
+		else
+		{
+			// Another producer was faster
+			position = writePosition.get();
+		}
+	}
+
+	request->loader = loader;
+	request->sequence.set(position + 1);
+
+	// Only one producer wakes up the thread (if it is busy, it will find the request anyway)
+	if(isWaiting.compareAndSetBool(0, 1)) wakeUp.signal();
+
+	return true;
+}
+
+SampleLoader *StreamingThread::getNextRequest() noexcept
+{
+	const uint32 position = readPosition.get();
+
+	Request &request = requests[(int)(position & mask)];
+
+	// The slot is still empty (or a producer has not finished writing it)
+	if((int)(request.sequence.get() - (position + 1)) < 0) return nullptr;
+
+	SampleLoader *loader = request.loader;
+
+	request.sequence.set(position + mask + 1);
+	readPosition.set(position + 1);
+
+	return loader;
+}
+
+void StreamingThread::run()
+{
+	while( ! threadShouldExit())
+	{
+		SampleLoader *loader = getNextRequest();
+
+		if(loader == nullptr)
+		{
+			// A request that is added after this check finds the flag and wakes up the thread
+			isWaiting.set(1);
+
+			loader = getNextRequest();
+
+			if(loader == nullptr) wakeUp.wait(500);
+
+			isWaiting.set(0);
+
+			if(loader == nullptr) continue;
+		}
+
+		// If the horizon moved while the blocks were read, the loader can read on directly
+		while(loader->runJob());
+	}
+}
+
+// ==================================================================================================== SharedStreamingEngine methods
+
+CriticalSection SharedStreamingEngine::instanceLock;
+SharedStreamingEngine *SharedStreamingEngine::instance = nullptr;
+int SharedStreamingEngine::numUsers = 0;
+
+SharedStreamingEngine::SharedStreamingEngine():
+	largestStreamBufferSize(0),
+	adaptionThread(*this)
+{
+	adaptionThread.startThread(3);
+}
+
+SharedStreamingEngine::~SharedStreamingEngine()
+{
+	adaptionThread.stopThread(5000);
+
+	// All samplers must be deleted before the engine, so no sound of the pool should be used anymore
+	jassert(pooledSounds.size() == 0 || pooledSounds.getUnchecked(0)->getReferenceCount() == 1);
+}
+
+SharedStreamingEngine *SharedStreamingEngine::acquire()
+{
+	const ScopedLock sl(instanceLock);
+
+	if(instance == nullptr) instance = new SharedStreamingEngine();
+
+	numUsers++;
+
+	return instance;
+}
+
+void SharedStreamingEngine::release()
+{
+	const ScopedLock sl(instanceLock);
+
+	jassert(numUsers > 0);
+
+	if(--numUsers == 0)
+	{
+		delete instance;
+		instance = nullptr;
+	}
+}
+
+String SharedStreamingEngine::getSoundKey(const File &file)
+{
+	return file.getFullPathName() + "|" + String(file.getLastModificationTime().toMilliseconds());
+}
+
+StreamingSamplerSound::Ptr SharedStreamingEngine::getSound(const File &file)
+{
+	const String key = getSoundKey(file);
+
+	const ScopedLock sl(poolLock);
+
+	const int index = pooledSoundKeys.indexOf(key);
+
+	if(index != -1) return StreamingSamplerSound::Ptr(pooledSounds.getUnchecked(index));
+
+	// The mappings are added by the samplers (see MappedStreamingSound)
+	StreamingSamplerSound::Ptr sound = new StreamingSamplerSound(file, BigInteger(), 60);
+
+	pooledSounds.add(sound);
+	pooledSoundKeys.add(key);
+
+	return sound;
+}
+
+void SharedStreamingEngine::releaseUnusedSounds()
+{
+	const ScopedLock sl(poolLock);
+
+	for(int i = pooledSounds.size() - 1; i >= 0; i--)
+	{
+		// The pool holds the last reference
+		if(pooledSounds.getUnchecked(i)->getReferenceCount() == 1)
+		{
+			pooledSounds.remove(i);
+			pooledSoundKeys.remove(i);
+		}
+	}
+}
+
+int SharedStreamingEngine::getNumSounds() const
+{
+	const ScopedLock sl(poolLock);
+
+	return pooledSounds.size();
+}
+
+void SharedStreamingEngine::reportStreamBufferSize(int streamBufferSize) noexcept
+{
+	for(;;)
+	{
+		const int currentSize = largestStreamBufferSize.get();
+
+		if(streamBufferSize <= currentSize || largestStreamBufferSize.compareAndSetBool(streamBufferSize, currentSize)) return;
+	}
+}
+
+void SharedStreamingEngine::registerSampler(StreamingSampler *sampler)
+{
+	const ScopedLock sl(samplerLock);
+
+	samplers.addIfNotAlreadyThere(sampler);
+}
+
+void SharedStreamingEngine::unregisterSampler(StreamingSampler *sampler)
+{
+	const ScopedLock sl(samplerLock);
+
+	samplers.removeFirstMatchingValue(sampler);
+}
+
+void SharedStreamingEngine::addPreloadRequest(Array<PreloadRequest> &requests, StreamingSamplerSound *sound, int preloadSize, bool exceedsBudget)
+{
+	for(int i = 0; i < requests.size(); i++)
+	{
+		PreloadRequest &request = requests.getReference(i);
+
+		if(request.sound == sound)
+		{
+			request.preloadSize = jmax(request.preloadSize, preloadSize);
+			request.exceedsBudget |= exceedsBudget;
+			return;
+		}
+	}
+
+	PreloadRequest request = { sound, preloadSize, exceedsBudget };
+	requests.add(request);
+}
+
+void SharedStreamingEngine::adaptPreloadSizes()
+{
+	// The lock is held while the preload buffers are read, so a sampler can't be deleted while it is adapted
+	const ScopedLock sl(samplerLock);
+
+	Array<PreloadRequest> requests;
+
+	for(int i = 0; i < samplers.size(); i++) samplers.getUnchecked(i)->addPreloadRequests(requests);
+
+	for(int i = 0; i < requests.size(); i++)
+	{
+		const PreloadRequest &request = requests.getReference(i);
+
+		const int newSize = request.preloadSize;
+		const int currentSize = request.sound->getPreloadSize();
+
+		// Grow immediately, but only shrink if it saves at least the half of the buffer (or if a budget is exceeded)
+		if(newSize > currentSize || newSize < currentSize / 2 || (request.exceedsBudget && newSize < currentSize))
+		{
+			try
+			{
+				request.sound->setPreloadSize(newSize);
+			}
+			catch(LoadingError error)
+			{
+				// The sound keeps its old preload buffer
+				DBG("Error resizing the preload buffer: " + error.fileName + ": " + error.errorDescription);
+			}
+		}
+	}
+
+	// The buffers that were retired by a resize are usually still played when they are retired, so they are freed here
+	const ScopedLock pl(poolLock);
+
+	for(int i = 0; i < pooledSounds.size(); i++) pooledSounds.getUnchecked(i)->releaseUnusedPreloadBuffers();
+}
+
+SharedStreamingEngine::AdaptionThread::AdaptionThread(SharedStreamingEngine &parent_):
+	Thread("Preload adaption thread"),
+	parent(parent_)
+{
+}
+
+void SharedStreamingEngine::AdaptionThread::run()
+{
+	while( ! threadShouldExit())
+	{
+		wait(PRELOAD_ADAPTION_INTERVAL_MS);
+
+		if( ! threadShouldExit()) parent.adaptPreloadSizes();
+	}
+}
+
+// ==================================================================================================== SampleLoader methods
+
+SampleLoader::~SampleLoader()
+{
+	reset();
+
+	// The thread must not read a request of a deleted loader
+	while(jobIsPending.get() != 0 && backgroundThread != nullptr && backgroundThread->isThreadRunning())
+	{
+		Thread::sleep(1);
+	}
+
+	delete pendingStreamBuffers.get();
+	delete retiredStreamBuffers.get();
+}
+
+/** Sets the buffer size in samples. */
+void SampleLoader::setBufferSize(int newBufferSize)
+{
+	releaseUnusedBuffers();
+
+	if(bufferPool != nullptr)
+	{
+		// The pool buffers can't grow, so the capacity is simply limited
+		pendingBufferCapacity.set(jmin(newBufferSize, bufferPool->getBufferSize()));
+	}
+	else
+	{
+		pendingBufferCapacity.set(newBufferSize);
+
+		if(ownedStreamBuffers == nullptr || newBufferSize > bufferStride)
+		{
+#if INTERLEAVED_STREAM_BUFFERS
+			// Both channels are stored in one interleaved buffer
+			ResidentSampleBuffer *newBuffers = new ResidentSampleBuffer(1, 2 * newBufferSize * NUM_STREAM_BUFFERS);
+#else
+			ResidentSampleBuffer *newBuffers = new ResidentSampleBuffer(2, newBufferSize * NUM_STREAM_BUFFERS);
+#endif
+			newBuffers->clear();
+
+			// If the previous buffers were not swapped in yet, they can be deleted right away
+			delete pendingStreamBuffers.exchange(newBuffers);
+		}
+	}
+}
+
+void SampleLoader::adoptPendingBuffers()
+{
+	// The old buffers can only be retired if the previous ones are deleted
+	if(pendingStreamBuffers.get() != nullptr && retiredStreamBuffers.get() == nullptr)
+	{
+		ResidentSampleBuffer *newBuffers = pendingStreamBuffers.exchange(nullptr);
+
+		if(newBuffers != nullptr)
+		{
+			retiredStreamBuffers.set(ownedStreamBuffers.release());
+			ownedStreamBuffers = newBuffers;
+
+#if INTERLEAVED_STREAM_BUFFERS
+			bufferStride = newBuffers->getNumSamples() / (2 * NUM_STREAM_BUFFERS);
+
+			streamData[0] = newBuffers->getWritePointer(0);
+			streamData[1] = nullptr;
+#else
+			bufferStride = newBuffers->getNumSamples() / NUM_STREAM_BUFFERS;
+
+			streamData[0] = newBuffers->getWritePointer(0);
+			streamData[1] = newBuffers->getWritePointer(1);
+#endif
+		}
+	}
+
+	if(bufferPool != nullptr)
+	{
+		bufferStride = bufferPool->getBufferSize();
+	}
+
+	const int newCapacity = pendingBufferCapacity.get();
+
+	if(newCapacity > 0) bufferCapacity = jmin(newCapacity, bufferStride);
+}
+
+void SampleLoader::releaseUnusedBuffers()
+{
+	// The background thread might still write into the retired buffers
+	if(retiredStreamBuffers.get() != nullptr && jobIsPending.get() == 0)
+	{
+		delete retiredStreamBuffers.exchange(nullptr);
+	}
+}
+
+void SampleLoader::reset()
+{
+	SpinLock::ScopedLockType sl(lock);
+
+	sound = nullptr;
+	diskUsage = 0.0;
+
+	// Any pending read operation belongs to the old note now.
+	++noteIndex;
+	blocksFilled.set(0);
+	blocksRequested.set(0);
+
+	preload = nullptr;
+	anchorBuffer = nullptr;
+	anchorPosition = 0;
+	startIndex = 0;
+	playsFromMemory = false;
+
+	if(bufferSlot != -1)
+	{
+		// The background thread might still write into the slot, so it is released after the read operation.
+		slotToRelease = bufferSlot;
+		bufferSlot = -1;
+
+		streamData[0] = nullptr;
+		streamData[1] = nullptr;
+
+		releaseIsPending.set(1);
+
+		if(jobIsPending.compareAndSetBool(1, 0))
+		{
+			releasePendingSlot();
+			jobIsPending.set(0);
+		}
+	}
+}
+
+void SampleLoader::releasePendingSlot()
+{
+	if(releaseIsPending.compareAndSetBool(0, 1))
+	{
+		bufferPool->releaseSlot(slotToRelease);
+	}
+}
+
+int SampleLoader::getAdaptedBufferSize(StreamingSamplerSound const *s, double rate) const
+{
+	const int preloadSize = preload->buffer.getNumSamples();
+
+	// The biggest segments are the most efficient ones if there is no deadline
+	if(offlineMode) return jmin(bufferCapacity, preloadSize);
+
+#if USE_ADAPTIVE_STREAM_BUFFERS
+
+	const double latency = s->getReadLatency();
+
+	// Nothing was measured yet, so play it safe.
+	if(latency < 0.0) return jmin(bufferCapacity, preloadSize);
+
+	const int samplesDuringRead = (int)(latency * STREAM_LATENCY_SAFETY_FACTOR * s->getSampleRate() * rate);
+
+	// The stream buffers must hold one callback at the highest pitch (plus the samples for the interpolation)
+	const int sizeForCallback = (maximumBlockSize * MAX_SAMPLER_PITCH + 2 + NUM_STREAM_BUFFERS - 2) / (NUM_STREAM_BUFFERS - 1);
+
+	// If you hit this assert, the buffer size is too small for the block size of the audio callback
+	jassert(sizeForCallback <= bufferCapacity);
+
+	const int adaptedSize = jlimit(jmin(jmax(MIN_BUFFER_SIZE_FOR_STREAM_BUFFERS, sizeForCallback), bufferCapacity), bufferCapacity, samplesDuringRead);
+
+	// The stream buffer must not be bigger than the preload buffer
+	return jmin(adaptedSize, preloadSize);
+
+#else
+
+	ignoreUnused(rate);
+	return jmin(bufferCapacity, preloadSize);
+
+#endif
+}
+
+int SampleLoader::getNumBlocksToReadAhead() const noexcept
+{
+	StreamingSamplerSound const *s = sound;
+
+	if(s == nullptr) return 1;
+
+	if(offlineMode) return NUM_STREAM_BUFFERS - 1;
+
+	const double latency = s->getReadLatency();
+
+	// The amount of samples the voice will consume until the background thread has read the next block. 
+	// If nothing was measured yet, it reads one block ahead for every unit of playback rate.
+	const double horizon = latency < 0.0 ? (double)bufferSize * maxPlaybackRate
+										 : latency * STREAM_LATENCY_SAFETY_FACTOR * s->getSampleRate() * maxPlaybackRate;
+
+	const int numBlocks = (int)std::ceil(horizon / (double)bufferSize);
+
+	// The range of one audio callback must be loaded as well (a big block at a high pitch spans several stream buffers)
+	const int numBlocksPerCallback = (samplesPerCallback + bufferSize - 1) / bufferSize + 1;
+
+	// One buffer is always needed for the current read position
+	return jlimit(1, NUM_STREAM_BUFFERS - 1, numBlocks + numBlocksPerCallback);
+}
+
+bool SampleLoader::startNote(StreamingSamplerSound const *s, double playbackRate_, int64 startOffset)
+{
+	SpinLock::ScopedLockType sl(lock);
+
+	adoptPendingBuffers();
+
+	// The loader keeps a reference to the preload buffer until the note ends, so the sound can swap in a new one at any time.
+	StreamingSamplerSound::PreloadData::Ptr newPreload = s->getPreloadData();
+
+	playsFromMemory = newPreload->containsEntireSample;
+
+	// A sample in memory doesn't need stream buffers
+	if(bufferPool != nullptr && bufferSlot == -1 && ! playsFromMemory)
+	{
+		// If the previous note's slot was not released yet, it can be used again
+		if(releaseIsPending.compareAndSetBool(0, 1))	bufferSlot = slotToRelease;
+		else											bufferSlot = bufferPool->acquireSlot();
+
+		// The pool has no free stream buffers
+		if(bufferSlot == -1) return false;
+
+		// The two channels of a slot are adjacent, so an interleaved buffer simply uses both
+		streamData[0] = bufferPool->getSlotData(bufferSlot, 0);
+		streamData[1] = INTERLEAVED_STREAM_BUFFERS ? nullptr : bufferPool->getSlotData(bufferSlot, 1);
+	}
+
+	diskUsage = 0.0;
+
+	sound = s;
+	playbackRate = playbackRate_;
+	maxPlaybackRate = playbackRate_;
+
+	preload = newPreload;
+
+	// The buffer size can only change between two notes, because the block index depends on it. 
+	// A sample in memory is a single block, so the read position never reaches a stream buffer.
+	bufferSize = playsFromMemory ? preload->buffer.getNumSamples() : getAdaptedBufferSize(s, playbackRate);
+
+	// The note starts at the last anchor before the offset and streams the rest of the sample from there
+	const int anchorIndex = preload->getAnchorIndex(startOffset);
+
+	anchorBuffer = &preload->getAnchorBuffer(anchorIndex);
+	anchorPosition = preload->getAnchorPosition(anchorIndex);
+
+	// If you hit this assert, you have to increase the buffer size of the preload buffer - it must be at least as big as
+	// the streaming buffers.
+	jassert(anchorBuffer->getNumSamples() >= bufferSize);
+
+	// Every block that fits into the preload buffer is read directly from there
+	numPreloadBlocks = jmax(1, anchorBuffer->getNumSamples() / bufferSize);
+
+	// The start must be inside the last preloaded block, so the background thread has at least one block of time to read the next one
+	const int64 maxStartIndex = playsFromMemory ? (int64)(bufferSize - 1) : (int64)(numPreloadBlocks - 1) * bufferSize;
+
+	startIndex = (int)jmin<int64>(startOffset - anchorPosition, maxStartIndex);
+
+	// Any pending read operation belongs to the old note now.
+	++noteIndex;
+
+	blocksFilled.set(numPreloadBlocks);
+	blocksRequested.set(numPreloadBlocks);
+
+	// The next blocks will be filled on the next free thread pool slot
+	updateReadPosition(startIndex);
+
+	return true;
+};
+
+void SampleLoader::updateReadPosition(int sampleIndex)
+{
+	readBlock = sampleIndex / bufferSize;
+
+	if(playsFromMemory) return;
+
+	// The background thread must not overwrite a stream buffer that is currently read
+	const int maxBlocks = jmax(readBlock, numPreloadBlocks) + NUM_STREAM_BUFFERS;
+
+	const int blocksToRequest = jmin(readBlock + 1 + getNumBlocksToReadAhead(), maxBlocks);
+
+	if(blocksToRequest > blocksRequested.get())
+	{
+		blocksRequested.set(blocksToRequest);
+	}
+
+	if(blocksRequested.get() > blocksFilled.get())
+	{
+		requestNewData();
+	}
+}
+
+double SampleLoader::getBufferFillRatio() const noexcept
+{
+	const int numBlocksAhead = blocksRequested.get() - readBlock - 1;
+
+	if(sound == nullptr || numBlocksAhead <= 0) return 1.0;
+
+	return jlimit(0.0, 1.0, (double)(blocksFilled.get() - readBlock - 1) / (double)numBlocksAhead);
+}
+
+double SampleLoader::getLatencyLoad() const noexcept
+{
+	StreamingSamplerSound const *s = sound;
+
+	if(s == nullptr || playsFromMemory || s->getReadLatency() < 0.0) return 0.0;
+
+	const double samplesDuringRead = s->getReadLatency() * s->getSampleRate() * maxPlaybackRate;
+
+	return samplesDuringRead / (double)(bufferSize * (NUM_STREAM_BUFFERS - 1));
+}
+
+const float *SampleLoader::getBlockReadPointer(int blockIndex, int channel) const
+{
+	if(blockIndex < numPreloadBlocks)
+	{
+		return anchorBuffer->getReadPointer(channel, blockIndex * bufferSize);
+	}
+
+	const int bufferIndex = (blockIndex - numPreloadBlocks) % NUM_STREAM_BUFFERS;
+
+	return streamData[channel] + bufferIndex * bufferStride;
+}
+
+bool SampleLoader::prepareSampleRange(int sampleIndex, int numSamples)
+{
+	jassert(sound != nullptr);
+
+	samplesPerCallback = numSamples;
+
+	// Since the numSamples is only a estimate, the sampleIndex is used for the exact clock
+	updateReadPosition(sampleIndex);
+
+	const int lastBlockIndex = (sampleIndex + numSamples - 1) / bufferSize;
+
+	if(offlineMode) waitForBlock(lastBlockIndex);
+
+	return lastBlockIndex < blocksFilled.get();
+}
+
+void SampleLoader::requestReadAhead()
+{
+	updateReadPosition(readBlock * bufferSize);
+}
+
+void SampleLoader::waitForBlock(int blockIndex)
+{
+	// Blocks after the requested horizon can't be read yet (the stream buffers are still used)
+	while(sound != nullptr && blockIndex >= blocksFilled.get() && blockIndex < blocksRequested.get())
+	{
+		if(jobIsPending.compareAndSetBool(1, 0))
+		{
+			// The background thread is not reading this loader, so the blocks are read right here
+			requestTime = Time::highResolutionTicksToSeconds(Time::getHighResolutionTicks());
+
+			while(runJob());
+		}
+		else
+		{
+			Thread::yield();
+		}
+	}
+}
+
+int SampleLoader::getReadPointers(int sampleIndex, const float *&l, const float *&r, int &stride) const
+{
+	const int blockIndex = sampleIndex / bufferSize;
+	const int indexInBlock = sampleIndex % bufferSize;
+
+	jassert(blockIndex < blocksFilled.get());
+
+	if(blockIndex >= numPreloadBlocks)
+	{
+		const int bufferIndex = (blockIndex - numPreloadBlocks) % NUM_STREAM_BUFFERS;
+
+		const float *interleavedBlock = mappedBlocks[bufferIndex];
+
+#if INTERLEAVED_STREAM_BUFFERS
+		// The stream buffers have the same layout as the mapped blocks
+		if(interleavedBlock == nullptr) interleavedBlock = streamData[0] + 2 * bufferIndex * bufferStride;
+#endif
+
+		if(interleavedBlock != nullptr)
+		{
+			l = interleavedBlock + 2 * indexInBlock;
+			r = l + 1;
+			stride = 2;
+
+			return bufferSize - indexInBlock;
+		}
+	}
+
+	stride = 1;
+
+	l = getBlockReadPointer(blockIndex, 0) + indexInBlock;
+	r = getBlockReadPointer(blockIndex, 1) + indexInBlock;
+
+	return bufferSize - indexInBlock;
+}
+
+bool SampleLoader::runJob()
+{
+	const double readStart = Time::highResolutionTicksToSeconds(Time::getHighResolutionTicks());
+
+	bool isFirstBlock = true;
+
+	while(fillNextBlock())
+	{
+		if(isFirstBlock)
+		{
+			// The latency includes the time the request was waiting in the queue
+			const double latency = Time::highResolutionTicksToSeconds(Time::getHighResolutionTicks()) - requestTime;
+
+			StreamingSamplerSound const *s = sound;
+			if(s != nullptr) s->reportReadLatency(latency, maxPlaybackRate);
+
+			isFirstBlock = false;
+		}
+
+		if(backgroundThread != nullptr && backgroundThread->threadShouldExit()) break;
+	}
+
+	const double readStop = Time::highResolutionTicksToSeconds(Time::getHighResolutionTicks());
+	const double readTime = (readStop - readStart);
+	const double timeSinceLastCall = readStop - lastCallToRequestData;
+	const double diskUsageThisTime =  readTime / timeSinceLastCall;
+	diskUsage = jmax(diskUsage, diskUsageThisTime);
+	lastCallToRequestData = readStart;
+
+	jobIsPending.set(0);
+
+	// The voice was stopped while the job was reading, so the stream buffers can go back to the pool now
+	releasePendingSlot();
+
+	// The audio thread might have moved the horizon after the last block was read
+	if(sound != nullptr && blocksRequested.get() > blocksFilled.get() && jobIsPending.compareAndSetBool(1, 0))
+	{
+		// The job runs again right away, so it didn't wait in the queue
+		requestTime = Time::highResolutionTicksToSeconds(Time::getHighResolutionTicks());
+
+		return true;
+	}
+
+	return false;
+}
+
+void SampleLoader::requestNewData()
+{
+	// A poor man's mutex but gets the job done. If the job is already pending, it will read until the new horizon anyway.
+	if( ! jobIsPending.compareAndSetBool(1, 0)) return;
+
+	requestTime = Time::highResolutionTicksToSeconds(Time::getHighResolutionTicks());
+
+#if(USE_BACKGROUND_THREAD)
+
+	if( ! backgroundThread->addRequest(this))
+	{
+		// The queue is full. Increase MAX_NUM_STREAMING_REQUESTS (it must be bigger than the amount of voices).
+		jassertfalse;
+		jobIsPending.set(0);
+	}
+#else
+
+	// run the thread job synchronously
+	while(runJob());
+
+#endif
+};
+
+bool SampleLoader::fillNextBlock()
+{
+	StreamingSamplerSound const *s;
+	StreamingSamplerSound::PreloadData::Ptr data;
+	int blockIndex, bufferIndex, size, thisNote;
+	int64 streamOffset;
+	float *channels[2];
+
+	{
+		SpinLock::ScopedLockType sl(lock);
+
+		s = sound;
+		data = preload;
+		blockIndex = blocksFilled.get();
+
+		if(s == nullptr || blockIndex >= blocksRequested.get()) return false;
+
+		size = bufferSize;
+		thisNote = noteIndex;
+		streamOffset = anchorPosition;
+
+		bufferIndex = (blockIndex - numPreloadBlocks) % NUM_STREAM_BUFFERS;
+
+		jassert(bufferIndex >= 0);
+
+#if INTERLEAVED_STREAM_BUFFERS
+		channels[0] = streamData[0] + 2 * bufferIndex * bufferStride;
+		channels[1] = nullptr;
+#else
+		channels[0] = streamData[0] + bufferIndex * bufferStride;
+		channels[1] = streamData[1] + bufferIndex * bufferStride;
+#endif
+	}
+
+	const int64 streamPosition = streamOffset + (int64)blockIndex * size;
+
+	// If the samples are already resident in the mapped file, the voice reads them from there without a copy
+	const float *mappedBlock = s->getResidentMappedSamples(streamPosition, size, *data);
+
+	if(mappedBlock == nullptr)
+	{
+#if INTERLEAVED_STREAM_BUFFERS
+		fillInterleavedBlock(s, channels[0], size, streamPosition, *data);
+#else
+		AudioSampleBuffer blockBuffer(channels, 2, size);
+
+		s->fillSampleBuffer(blockBuffer, size, streamPosition, *data);
+#endif
+	}
+
+	SpinLock::ScopedLockType sl(lock);
+
+	// Only publish the block if the voice is still playing the same note
+	if(thisNote == noteIndex)
+	{
+		mappedBlocks[bufferIndex] = mappedBlock;
+		blocksFilled.set(blockIndex + 1);
+	}
+
+	return true;
+};
+
+void SampleLoader::fillInterleavedBlock(StreamingSamplerSound const *s, float *destination, int numSamples, int64 streamPosition, 
+										const StreamingSamplerSound::PreloadData &data)
+{
+	const int chunkSize = 512;
+
+	float left[chunkSize];
+	float right[chunkSize];
+	float *chunkChannels[2] = { left, right };
+
+	for(int offset = 0; offset < numSamples; offset += chunkSize)
+	{
+		const int numThisTime = jmin(chunkSize, numSamples - offset);
+
+		AudioSampleBuffer chunk(chunkChannels, 2, numThisTime);
+
+		s->fillSampleBuffer(chunk, numThisTime, streamPosition + offset, data);
+
+		float *frame = destination + 2 * offset;
+
+		for(int i = 0; i < numThisTime; i++)
+		{
+			frame[2 * i] = left[i];
+			frame[2 * i + 1] = right[i];
+		}
+	}
+}
+
+// ==================================================================================================== StreamingSamplerVoice methods
+
+StreamingSamplerVoice::StreamingSamplerVoice(StreamingThread *backgroundThread, StreamingBufferPool *bufferPool):
+pitchData(nullptr),
+voiceUptime(0.0),
+uptimeDelta(0.0),
+sampleStartOffset(0),
+velocity(0.0f),
+noteIndex(0),
+noteCounter(nullptr),
+gain(1.0f),
+pan(0.0f),
+currentGainL(0.0f),
+currentGainR(0.0f),
+targetGainL(0.0f),
+targetGainR(0.0f),
+gainStepL(0.0f),
+gainStepR(0.0f),
+smoothingSamplesRemaining(0),
+mixMode(OVERWRITE_BUFFER_WITH_VOICE_DATA ? OverwriteBuffer : AddToBuffer),
+fadeGain(1.0f),
+fadeDelta(0.0f),
+fadeSamplesRemaining(0),
+loader(backgroundThread, bufferPool)
 {
-	WavAudioFormat waf;
-	memoryReader = waf.createMemoryMappedReader(fileToLoad);
-	
-	if(memoryReader != nullptr) memoryReader->mapEntireFile();
+};
+
+void StreamingSamplerVoice::startNote (int midiNoteNumber, 
+									   float noteVelocity, 
+									   SynthesiserSound* s, 
+									   int /*currentPitchWheelPosition*/)
+{
+	// The StreamingSampler only contains StreamingSoundMappings, so the type is only checked in debug builds
+	jassert(dynamic_cast<StreamingSoundMapping*>(s) != nullptr);
+
+	StreamingSoundMapping *mapping = static_cast<StreamingSoundMapping*>(s);
+	StreamingSamplerSound *sound = mapping->getStreamingSound();
+
+	velocity = noteVelocity;
+	// Without a shared counter, the index only orders the notes of this voice
+	noteIndex = noteCounter != nullptr ? ++(*noteCounter) : noteIndex + 1;
+
+	// The new note starts with the gain of its velocity (the smoothing is only for changes while the note plays)
+	updateTargetGains(false);
+
+	fadeGain = 1.0f;
+	fadeDelta = 0.0f;
+	fadeSamplesRemaining = 0;
+
+	const double pitchFactor = jmin(mapping->getPitchFactor(midiNoteNumber), (double)MAX_SAMPLER_PITCH);
+
+	// Highly pitched notes stream a decimated octave version, which needs less samples for the same output
+	const int octave = sound->getOctaveForPlaybackRate(pitchFactor);
+
+	uptimeDelta = pitchFactor / (double)(1 << octave);
+
+	const int64 startOffset = (sampleStartOffset + sound->getStartOffsetForVelocity(noteVelocity)) >> octave;
+
+	if( ! loader.startNote(sound->getOctaveVersion(octave), uptimeDelta, startOffset))
+	{
+		// There are no free stream buffers in the pool, so the note is dropped
+		clearCurrentNote();
+		return;
+	}
+
+	// The voice position is relative to the start anchor that the loader uses
+	voiceUptime = (double)loader.getStartIndex();
+}
+
+
+void StreamingSamplerVoice::stopNote(bool allowTailOff)
+{
+	const StreamingSamplerSound *sound = loader.getLoadedSound();
+
+	const int numReleaseSamples = sound != nullptr ? (int)(sound->getReleaseTime() * 0.001 * getSampleRate()) : 0;
+
+	if(allowTailOff && numReleaseSamples > 0)
+	{
+		fadeOut(numReleaseSamples);
+	}
+	else
+	{
+		resetVoice();
+	}
+}
+
+void StreamingSamplerVoice::fadeOut(int numSamplesToFade)
+{
+	if(isFadingOut() && fadeSamplesRemaining <= numSamplesToFade) return;
+
+	fadeSamplesRemaining = jmax(1, numSamplesToFade);
+	fadeDelta = -fadeGain / (float)fadeSamplesRemaining;
+}
+
+void StreamingSamplerVoice::renderNextBlock(AudioSampleBuffer &outputBuffer, int startSample, int numSamples)
+{
+	const StreamingSamplerSound *sound = loader.getLoadedSound();
+
+	if(sound != nullptr)
+	{
+		const bool fadeEndsInThisBlock = isFadingOut() && fadeSamplesRemaining <= numSamples;
+
+		if(fadeEndsInThisBlock)
+		{
+			if(mixMode == OverwriteBuffer) outputBuffer.clear(startSample + fadeSamplesRemaining, numSamples - fadeSamplesRemaining);
+
+			// Only render until the fade out is finished
+			numSamples = fadeSamplesRemaining;
+		}
+
+		const int numSamplesToRender = numSamples;
+
+		const int pos = (int)voiceUptime;
+
+		double maxRate;
+		const double numSamplesUsed = getNumSamplesUsed(startSample, numSamples, maxRate);
+
+		const int samplesToCopy = (int)(numSamplesUsed) + 2; // get a few more for linear interpolating
+
+		if( ! sound->hasEnoughSamplesForBlock(loader.getAnchorPosition() + pos + samplesToCopy) )
+		{
+			resetVoice();
+			return;
+		}
+
+		// The loader reads further ahead if the voice consumes the samples faster
+		loader.setPlaybackRate((numSamplesUsed - (voiceUptime - pos)) / (double)numSamples, maxRate);
+
+		float *outL = outputBuffer.getWritePointer(0, startSample);
+		float *outR = outputBuffer.getWritePointer(1, startSample);
+
+		if( ! loader.prepareSampleRange(pos, samplesToCopy))
+		{
+			// Oops, The background thread was not quickly enough. Try to increase the preload / buffer size.
+			jassertfalse;
+
+			if(mixMode == OverwriteBuffer)
+			{
+				FloatVectorOperations::clear(outL, numSamples);
+				FloatVectorOperations::clear(outR, numSamples);
+			}
+
+			// Keep the clock running, so the voice stays in sync when the samples arrive
+			voiceUptime = pos + numSamplesUsed;
+			advanceGains(numSamples);
+			numSamples = 0;
+		}
+
+		if(mixMode == OverwriteBuffer)	renderSamples<OverwriteBuffer>(outL, outR, startSample, numSamples);
+		else							renderSamples<AddToBuffer>(outL, outR, startSample, numSamples);
+
+		if(isFadingOut())
+		{
+			fadeGain = jmax(0.0f, fadeGain);
+			fadeSamplesRemaining -= numSamplesToRender;
+
+			// The fade out is finished, so the voice and its stream buffers are free again
+			if(fadeEndsInThisBlock) resetVoice();
+		}
+	}
+};
+
+bool StreamingSamplerVoice::prepareBatchBlock(int startSample, int numSamples)
+{
+	const StreamingSamplerSound *sound = loader.getLoadedSound();
+
+	if(sound == nullptr || pitchData != nullptr || mixMode != AddToBuffer) return false;
+
+	if(isFadingOut() && fadeSamplesRemaining <= numSamples) return false;
+
+	const int pos = (int)voiceUptime;
+
+	double maxRate;
+	const double numSamplesUsed = getNumSamplesUsed(startSample, numSamples, maxRate);
+
+	const int samplesToCopy = (int)(numSamplesUsed) + 2;
+
+	if( ! sound->hasEnoughSamplesForBlock(loader.getAnchorPosition() + pos + samplesToCopy) ) return false;
+
+	loader.setPlaybackRate((numSamplesUsed - (voiceUptime - pos)) / (double)numSamples, maxRate);
+
+	// If the samples are missing, renderNextBlock() prepares the range again and keeps the clock running
+	return loader.prepareSampleRange(pos, samplesToCopy);
+}
+
+bool StreamingSamplerVoice::getBatchLane(int numSamples, BatchLane &lane) const
+{
+	const int index = (int)voiceUptime;
+
+	const float *inL;
+	const float *inR;
+	int stride;
+
+	const int numInBlock = loader.getReadPointers(index, inL, inR, stride);
+
+	// The interpolation of the last sample reads the sample after it
+	const int lastIndex = (int)(voiceUptime + (double)(numSamples - 1) * uptimeDelta) + 1;
+
+	// The kernels step a float position, which can round up to the next sample, so one extra sample must be in the block
+	if(lastIndex + 1 - index >= numInBlock) return false;
+
+	lane.left = inL;
+	lane.right = inR;
+	lane.stride = stride;
+	lane.position = (float)(voiceUptime - (double)index);
+	lane.increment = (float)uptimeDelta;
+	lane.gains = getChunkGains(numSamples);
+
+	return true;
+}
+
+void StreamingSamplerVoice::renderChunkDirectly(float *outL, float *outR, int startSample, int numSamples)
+{
+	renderSamples<ConstantPitch, AddToBuffer>(outL, outR, startSample, numSamples);
+}
+
+void StreamingSamplerVoice::setGain(float newGain) noexcept
+{
+	gain = jmax(0.0f, newGain);
+	updateTargetGains(true);
+}
+
+void StreamingSamplerVoice::setPan(float newPan) noexcept
+{
+	pan = jlimit(-1.0f, 1.0f, newPan);
+	updateTargetGains(true);
+}
+
+void StreamingSamplerVoice::updateTargetGains(bool smoothChange) noexcept
+{
+	// The pan is a balance control, so the center position plays the sample unchanged
+	const float noteGain = velocity * gain;
+
+	targetGainL = noteGain * jmin(1.0f, 1.0f - pan);
+	targetGainR = noteGain * jmin(1.0f, 1.0f + pan);
+
+	if(smoothChange)
+	{
+		smoothingSamplesRemaining = VOICE_GAIN_SMOOTHING_SAMPLES;
+		gainStepL = (targetGainL - currentGainL) / (float)VOICE_GAIN_SMOOTHING_SAMPLES;
+		gainStepR = (targetGainR - currentGainR) / (float)VOICE_GAIN_SMOOTHING_SAMPLES;
+	}
+	else
+	{
+		smoothingSamplesRemaining = 0;
+		currentGainL = targetGainL;
+		currentGainR = targetGainR;
+	}
+}
+
+StreamingSamplerVoice::ChunkGains StreamingSamplerVoice::getChunkGains(int numSamples) const noexcept
+{
+	const int numSmoothed = jmin(numSamples, smoothingSamplesRemaining);
+
+	const float fadeGainAtEnd = fadeGain + fadeDelta * (float)numSamples;
+
+	const float gainAtEndL = smoothingSamplesRemaining == numSmoothed ? targetGainL : currentGainL + gainStepL * (float)numSmoothed;
+	const float gainAtEndR = smoothingSamplesRemaining == numSmoothed ? targetGainR : currentGainR + gainStepR * (float)numSmoothed;
+
+	// The product of the fade and the smoothed gain is approximated with one linear ramp per chunk
+	ChunkGains gains;
+
+	gains.left = fadeGain * currentGainL;
+	gains.right = fadeGain * currentGainR;
+	gains.leftDelta = (fadeGainAtEnd * gainAtEndL - gains.left) / (float)numSamples;
+	gains.rightDelta = (fadeGainAtEnd * gainAtEndR - gains.right) / (float)numSamples;
+
+	return gains;
+}
+
+void StreamingSamplerVoice::advanceGains(int numSamples) noexcept
+{
+	fadeGain += fadeDelta * (float)numSamples;
+
+	if(smoothingSamplesRemaining == 0) return;
+
+	if(numSamples >= smoothingSamplesRemaining)
+	{
+		smoothingSamplesRemaining = 0;
+		currentGainL = targetGainL;
+		currentGainR = targetGainR;
+	}
+	else
+	{
+		smoothingSamplesRemaining -= numSamples;
+		currentGainL += gainStepL * (float)numSamples;
+		currentGainR += gainStepR * (float)numSamples;
+	}
+}
+
+double StreamingSamplerVoice::getNumSamplesUsed(int startSample, int numSamples, double &maxRate) const noexcept
+{
+	double numSamplesUsed = voiceUptime - (int)voiceUptime;
+	maxRate = uptimeDelta;
+
+	if(pitchData != nullptr)
+	{
+		for(int i = startSample; i < startSample + numSamples; i++)
+		{
+			const double rate = getUptimeDelta(i);
+			numSamplesUsed += rate;
+			maxRate = jmax(maxRate, rate);
+		}
+	}
+	else
+	{
+		numSamplesUsed += uptimeDelta * (double)numSamples;
+	}
+
+	return numSamplesUsed;
+}
+
+template <StreamingSamplerVoice::MixMode mixMode> 
+void StreamingSamplerVoice::renderSamples(float *outL, float *outR, int startSample, int numSamples)
+{
+	// The kernel is selected once for the whole block. At the root pitch the position stays an integer, so no interpolation is needed
+	if(pitchData != nullptr)									renderSamples<ModulatedPitch, mixMode>(outL, outR, startSample, numSamples);
+	else if(uptimeDelta == 1.0 && voiceUptime == (int)voiceUptime)	renderSamples<UnityPitch, mixMode>(outL, outR, startSample, numSamples);
+	else														renderSamples<ConstantPitch, mixMode>(outL, outR, startSample, numSamples);
+}
+
+template <StreamingSamplerVoice::PitchMode mode, StreamingSamplerVoice::MixMode mixMode> 
+void StreamingSamplerVoice::renderSamples(float *outL, float *outR, int startSample, int numSamples)
+{
+	// The block is rendered in small chunks with one gain ramp per chunk (so the smoothing and the fade out are applied 
+	// in the same pass). For the other modes, the positions of the chunk are calculated first (for modulated pitch this 
+	// is a prefix sum of the per sample increments) and the samples are interpolated at these positions.
+	const int chunkSize = 64;
+
+	double positions[chunkSize];
+
+	while (numSamples > 0)
+	{
+		const int numThisTime = jmin(numSamples, chunkSize);
+
+		ChunkGains gains = getChunkGains(numThisTime);
+		advanceGains(numThisTime);
+
+		if(mode == UnityPitch)
+		{
+			// Copy the samples block by block directly from the stream buffers of the loader
+			int index = (int)voiceUptime;
+			int numCopied = 0;
+
+			while (numCopied < numThisTime)
+			{
+				const float *inL;
+				const float *inR;
+				int stride;
+
+				const int numInBlock = jmin(numThisTime - numCopied, loader.getReadPointers(index, inL, inR, stride));
+
+				jassert(numInBlock > 0);
+
+				writeWithGain<mixMode>(outL + numCopied, outR + numCopied, inL, inR, stride, numInBlock, gains);
+
+				index += numInBlock;
+				numCopied += numInBlock;
+			}
+
+			voiceUptime = (double)index;
+		}
+		else
+		{
+			if(mode == ConstantPitch)
+			{
+				for(int i = 0; i < numThisTime; i++) positions[i] = voiceUptime + (double)i * uptimeDelta;
+
+				voiceUptime += (double)numThisTime * uptimeDelta;
+			}
+			else
+			{
+				for(int i = 0; i < numThisTime; i++)
+				{
+					positions[i] = voiceUptime;
+					voiceUptime += getUptimeDelta(startSample + i);
+				}
+			}
+
+			interpolateWithGain<mixMode>(positions, outL, outR, numThisTime, gains);
+		}
+
+		outL += numThisTime;
+		outR += numThisTime;
+		startSample += numThisTime;
+		numSamples -= numThisTime;
+	}
+};
+
+template <StreamingSamplerVoice::MixMode mixMode>
+void StreamingSamplerVoice::writeWithGain(float *destL, float *destR, const float *sourceL, const float *sourceR, int sourceStride, int numSamples, ChunkGains &gains)
+{
+	if(gains.leftDelta == 0.0f && gains.rightDelta == 0.0f && sourceStride == 1)
+	{
+		if(mixMode == OverwriteBuffer)
+		{
+			FloatVectorOperations::copyWithMultiply(destL, sourceL, gains.left, numSamples);
+			FloatVectorOperations::copyWithMultiply(destR, sourceR, gains.right, numSamples);
+		}
+		else
+		{
+			FloatVectorOperations::addWithMultiply(destL, sourceL, gains.left, numSamples);
+			FloatVectorOperations::addWithMultiply(destR, sourceR, gains.right, numSamples);
+		}
+
+		return;
+	}
+
+	float gainL = gains.left;
+	float gainR = gains.right;
+
+	for(int i = 0; i < numSamples; i++)
+	{
+		const float l = sourceL[i * sourceStride] * gainL;
+		const float r = sourceR[i * sourceStride] * gainR;
+
+		if(mixMode == OverwriteBuffer)
+		{
+			destL[i] = l;
+			destR[i] = r;
+		}
+		else
+		{
+			destL[i] += l;
+			destR[i] += r;
+		}
+
+		gainL += gains.leftDelta;
+		gainR += gains.rightDelta;
+	}
+
+	gains.left = gainL;
+	gains.right = gainR;
+};
+
+template <StreamingSamplerVoice::MixMode mixMode>
+void StreamingSamplerVoice::interpolateWithGain(const double *positions, float *destL, float *destR, int numSamples, ChunkGains gains) const
+{
+	// The interpolation reads directly from the stream buffers of the loader, so the read pointers are fetched again at every block boundary
+	int blockStart = 0;
+	int numInBlock = 0;
+
+	const float *inL = nullptr;
+	const float *inR = nullptr;
+	int stride = 1;
+
+	for(int i = 0; i < numSamples; i++)
+	{
+		const int index = (int)positions[i];
+
+		int offset = index - blockStart;
+
+		if(offset < 0 || offset >= numInBlock)
+		{
+			numInBlock = loader.getReadPointers(index, inL, inR, stride);
+			blockStart = index;
+			offset = 0;
+
+			jassert(numInBlock > 0);
+		}
+
+		const float alpha = (float)(positions[i] - (double)index);
+		const float invAlpha = 1.0f - alpha;
+
+		const float *nextL;
+		const float *nextR;
+
+		if(offset + 1 < numInBlock)
+		{
+			nextL = inL + (offset + 1) * stride;
+			nextR = inR + (offset + 1) * stride;
+		}
+		else // the index is the last sample of the block, so the next sample is fetched from the next block
+		{
+			int nextStride;
+
+			loader.getReadPointers(index + 1, nextL, nextR, nextStride);
+		}
+
+		const float l = (inL[offset * stride] * invAlpha + *nextL * alpha) * gains.left;
+		const float r = (inR[offset * stride] * invAlpha + *nextR * alpha) * gains.right;
+
+		if(mixMode == OverwriteBuffer)
+		{
+			destL[i] = l;
+			destR[i] = r;
+		}
+		else
+		{
+			destL[i] += l;
+			destR[i] += r;
+		}
+
+		gains.left += gains.leftDelta;
+		gains.right += gains.rightDelta;
+	}
+};
+
+// ==================================================================================================== Batch render kernels
+
+/** Adds the interpolated samples of all lanes to the output. */
+static void renderLanesScalar(const BatchLane *lanes, int numLanes, float *outL, float *outR, int numSamples)
+{
+	for(int lane = 0; lane < numLanes; lane++)
+	{
+		const BatchLane &l = lanes[lane];
+
+		float gainL = l.gains.left;
+		float gainR = l.gains.right;
+
+		for(int i = 0; i < numSamples; i++)
+		{
+			const float position = l.position + (float)i * l.increment;
+			const int index = (int)position;
+			const float alpha = position - (float)index;
+
+			const float *inL = l.left + index * l.stride;
+			const float *inR = l.right + index * l.stride;
+
+			outL[i] += (inL[0] + (inL[l.stride] - inL[0]) * alpha) * gainL;
+			outR[i] += (inR[0] + (inR[l.stride] - inR[0]) * alpha) * gainR;
+
+			gainL += l.gains.leftDelta;
+			gainR += l.gains.rightDelta;
+		}
+	}
+}
+
+#if SIMD_X86 && VOICE_BATCH_SIZE == 8
+
+/** Returns the sums of the lanes of eight vectors (the sum of v[i] is in element i). */
+SIMD_TARGET("avx2") static inline __m256 sumLanesAVX(const __m256 *v)
+{
+	const __m256 s01 = _mm256_hadd_ps(v[0], v[1]);
+	const __m256 s23 = _mm256_hadd_ps(v[2], v[3]);
+	const __m256 s45 = _mm256_hadd_ps(v[4], v[5]);
+	const __m256 s67 = _mm256_hadd_ps(v[6], v[7]);
+
+	// Every 128 bit half contains the partial sums of four vectors
+	const __m256 s0123 = _mm256_hadd_ps(s01, s23);
+	const __m256 s4567 = _mm256_hadd_ps(s45, s67);
+
+	return _mm256_add_ps(_mm256_permute2f128_ps(s0123, s4567, 0x20), _mm256_permute2f128_ps(s0123, s4567, 0x31));
+}
+
+/** Gathers one sample of each lane (the addresses are byte offsets to base). */
+SIMD_TARGET("avx2") static inline __m256 gatherLanesAVX(const float *base, __m256i addressesLo, __m256i addressesHi, __m256i offsets)
+{
+	const __m256i offsetsLo = _mm256_cvtepi32_epi64(_mm256_castsi256_si128(offsets));
+	const __m256i offsetsHi = _mm256_cvtepi32_epi64(_mm256_extracti128_si256(offsets, 1));
+
+	const __m128 lo = _mm256_i64gather_ps(base, _mm256_add_epi64(addressesLo, offsetsLo), 1);
+	const __m128 hi = _mm256_i64gather_ps(base, _mm256_add_epi64(addressesHi, offsetsHi), 1);
+
+	return _mm256_insertf128_ps(_mm256_castps128_ps256(lo), hi, 1);
+}
+
+/** Renders exactly eight lanes with one voice per SIMD lane. */
+SIMD_TARGET("avx2") static void renderLanesAVX(const BatchLane *lanes, float *outL, float *outR, int numSamples)
+{
+	// The sample addresses are gathered relative to the first lane
+	const float *base = lanes[0].left;
 
-	else throw LoadingError(fileName, "file does not exist");
-	
-	if( ! memoryReader->getMappedSection().isEmpty() )
-	{
-		sampleRate = memoryReader->sampleRate;
+	int64 left[8], right[8];
+	int32 strides[8];
+	float positions[8], increments[8], gainsL[8], gainsR[8], deltasL[8], deltasR[8];
 
-		setPreloadSize(PRELOAD_SIZE);
-	}
-	else
+	for(int lane = 0; lane < 8; lane++)
 	{
-		throw LoadingError(fileName, "Error at memory mapping");
+		left[lane] = (int64)((const char*)lanes[lane].left - (const char*)base);
+		right[lane] = (int64)((const char*)lanes[lane].right - (const char*)base);
+		strides[lane] = lanes[lane].stride * (int32)sizeof(float);
+		positions[lane] = lanes[lane].position;
+		increments[lane] = lanes[lane].increment;
+		gainsL[lane] = lanes[lane].gains.left;
+		gainsR[lane] = lanes[lane].gains.right;
+		deltasL[lane] = lanes[lane].gains.leftDelta;
+		deltasR[lane] = lanes[lane].gains.rightDelta;
 	}
-}
 
-void StreamingSamplerSound::setPreloadSize(int newPreloadSize)
-{
-	preloadSize = newPreloadSize;
+	const __m256i leftLo = _mm256_loadu_si256((const __m256i*)left);
+	const __m256i leftHi = _mm256_loadu_si256((const __m256i*)(left + 4));
+	const __m256i rightLo = _mm256_loadu_si256((const __m256i*)right);
+	const __m256i rightHi = _mm256_loadu_si256((const __m256i*)(right + 4));
+	const __m256i stride = _mm256_loadu_si256((const __m256i*)strides);
 
-	int64 maxSize = memoryReader->getMappedSection().getLength();
+	const __m256 startPosition = _mm256_loadu_ps(positions);
+	const __m256 increment = _mm256_loadu_ps(increments);
+	const __m256 deltaL = _mm256_loadu_ps(deltasL);
+	const __m256 deltaR = _mm256_loadu_ps(deltasR);
+	__m256 gainL = _mm256_loadu_ps(gainsL);
+	__m256 gainR = _mm256_loadu_ps(gainsR);
 
-	if(newPreloadSize == -1 || preloadSize > maxSize)
+	// The lanes of eight samples are collected and summed up together
+	__m256 l[8], r[8];
+
+	for(int i = 0; i < numSamples; i += 8)
 	{
-		preloadSize = (int)maxSize;
-	};
+		const int numThisTime = jmin(8, numSamples - i);
 
-	try
+		for(int j = 0; j < 8; j++)
+		{
+			if(j >= numThisTime)
+			{
+				l[j] = _mm256_setzero_ps();
+				r[j] = _mm256_setzero_ps();
+				continue;
+			}
+
+			const __m256 position = _mm256_add_ps(startPosition, _mm256_mul_ps(_mm256_set1_ps((float)(i + j)), increment));
+			const __m256i index = _mm256_cvttps_epi32(position);
+			const __m256 alpha = _mm256_sub_ps(position, _mm256_cvtepi32_ps(index));
+
+			const __m256i offset = _mm256_mullo_epi32(index, stride);
+			const __m256i nextOffset = _mm256_add_epi32(offset, stride);
+
+			const __m256 l0 = gatherLanesAVX(base, leftLo, leftHi, offset);
+			const __m256 l1 = gatherLanesAVX(base, leftLo, leftHi, nextOffset);
+			const __m256 r0 = gatherLanesAVX(base, rightLo, rightHi, offset);
+			const __m256 r1 = gatherLanesAVX(base, rightLo, rightHi, nextOffset);
+
+			l[j] = _mm256_mul_ps(_mm256_add_ps(l0, _mm256_mul_ps(_mm256_sub_ps(l1, l0), alpha)), gainL);
+			r[j] = _mm256_mul_ps(_mm256_add_ps(r0, _mm256_mul_ps(_mm256_sub_ps(r1, r0), alpha)), gainR);
+
+			gainL = _mm256_add_ps(gainL, deltaL);
+			gainR = _mm256_add_ps(gainR, deltaR);
+		}
+
+		const __m256 sumL = sumLanesAVX(l);
+		const __m256 sumR = sumLanesAVX(r);
+
+		if(numThisTime == 8)
+		{
+			_mm256_storeu_ps(outL + i, _mm256_add_ps(_mm256_loadu_ps(outL + i), sumL));
+			_mm256_storeu_ps(outR + i, _mm256_add_ps(_mm256_loadu_ps(outR + i), sumR));
+		}
+		else
+		{
+			float sumsL[8], sumsR[8];
+
+			_mm256_storeu_ps(sumsL, sumL);
+			_mm256_storeu_ps(sumsR, sumR);
+
+			for(int j = 0; j < numThisTime; j++)
+			{
+				outL[i + j] += sumsL[j];
+				outR[i + j] += sumsR[j];
+			}
+		}
+	}
+}
+
+/** Fills a partial batch up with silent lanes for the AVX kernel. */
+static void renderBatchAVX(const BatchLane *lanes, int numLanes, float *outL, float *outR, int numSamples)
+{
+	// A single voice is faster without the gather overhead
+	if(numLanes == 1)
 	{
-		preloadBuffer = AudioSampleBuffer(2, preloadSize);
+		renderLanesScalar(lanes, numLanes, outL, outR, numSamples);
+		return;
 	}
-	catch(std::bad_alloc memoryExeption)
+
+	static const float silence[2] = { 0.0f, 0.0f };
+
+	BatchLane allLanes[VOICE_BATCH_SIZE];
+
+	for(int lane = 0; lane < VOICE_BATCH_SIZE; lane++)
 	{
-		throw LoadingError(fileName, "out of Memory!");
+		if(lane < numLanes) allLanes[lane] = lanes[lane];
+		else
+		{
+			BatchLane s = { silence, silence, 0, 0.0f, 0.0f, { 0.0f, 0.0f, 0.0f, 0.0f } };
+			allLanes[lane] = s;
+		}
 	}
 
-	memoryReader->read(&preloadBuffer, 0, preloadSize, 0, true, true);
+	renderLanesAVX(allLanes, outL, outR, numSamples);
 }
 
-bool StreamingSamplerSound::hasEnoughSamplesForBlock(int64 maxSampleIndexInFile) const
+#endif
+
+/** Adds the lanes of one chunk to the output with the kernel that was selected for the CPU. */
+static void renderLanes(const BatchLane *lanes, int numLanes, float *outL, float *outR, int numSamples)
 {
-	return maxSampleIndexInFile < memoryReader->getMappedSection().getEnd();
+	if(numLanes == 0) return;
+
+	getSimdKernelTable().renderLanes(lanes, numLanes, outL, outR, numSamples);
 }
 
-void StreamingSamplerSound::fillSampleBuffer(AudioSampleBuffer &sampleBuffer, int samplesToCopy, int uptime) const
+// ==================================================================================================== StreamingSampler methods
+
+StreamingSampler::StreamingSampler(StreamingThread *externalThread):
+	nextVoiceToRender(0),
+	engine(SharedStreamingEngine::acquire()),
+	backgroundThread(externalThread == nullptr ? engine->getThread() : externalThread),
+	numVoicesToCreate(0),
+	streamBufferSize(BUFFER_SIZE_FOR_STREAM_BUFFERS),
+	preloadBudget(DEFAULT_PRELOAD_BUDGET),
+	inMemoryLength(IN_MEMORY_SAMPLE_LENGTH),
+	maxPolyphony(1024), // The polyphony is limited by the amount of voices until you call setMaxPolyphony()
+	polyphonyLimit(1024),
+	maxStreamingLoad(0.75),
+	stealFadeTimeMs(5.0),
+	noteCounter(0),
+	offlineMode(false),
+	batchRendering(false)
 {
-	if(uptime + samplesToCopy < preloadSize)
-	{
-		FloatVectorOperations::copy(sampleBuffer.getWritePointer(0, 0), preloadBuffer.getReadPointer(0, uptime), samplesToCopy);
-		FloatVectorOperations::copy(sampleBuffer.getWritePointer(1, 0), preloadBuffer.getReadPointer(1, uptime), samplesToCopy);
-	}
-	else 
-	{
-		memoryReader->read(&sampleBuffer, 0, samplesToCopy, uptime, true, true);
-	}
-};
+	// The sampler is registered after all members are initialised, since the adaption thread might use it right away
+	engine->registerSampler(this);
+}
 
+void StreamingSampler::setNumRenderThreads(int numThreads, int maximumBlockSize)
+{
+	const ScopedLock sl(lock);
 
+	renderThreads.clear();
 
-// ==================================================================================================== SampleLoader methods
+	for(int i = 0; i < numThreads; i++) renderThreads.add(new RenderThread(*this, maximumBlockSize));
+}
 
-/** Sets the buffer size in samples. */
-void SampleLoader::setBufferSize(int newBufferSize)
+void StreamingSampler::setOfflineMode(bool shouldBeOffline)
 {
-	bufferSize = newBufferSize;
+	const ScopedLock sl(lock);
 
-	b1 = AudioSampleBuffer(2, bufferSize);
-	b2 = AudioSampleBuffer(2, bufferSize);
+	offlineMode = shouldBeOffline;
 
-	b1.clear();
-	b2.clear();
+	for(int i = 0; i < voices.size(); i++) getStreamingVoice(i)->setOfflineMode(shouldBeOffline);
+}
 
-	readBuffer = &b1;
-	writeBuffer = &b2;
+void StreamingSampler::setBatchRendering(bool shouldRenderInBatches) noexcept
+{
+	const ScopedLock sl(lock);
 
-	reset();
+	batchRendering = shouldRenderInBatches;
 }
 
-void SampleLoader::startNote(StreamingSamplerSound const *s)
+void StreamingSampler::renderVoices(AudioSampleBuffer &outputBuffer, int startSample, int numSamples)
 {
-	ScopedLock sl(lock);
+	if(offlineMode)
+	{
+		// Queue the reads of all voices first, so the background thread reads them while the first voices are rendered
+		for(int i = 0; i < voices.size(); i++) getStreamingVoice(i)->requestReadAhead();
+	}
 
-	diskUsage = 0.0;
+	int numPlayingVoices = 0;
+	bool allVoicesAdd = true;
 
-	sound = s;
-	readIndex = 0;
+	for(int i = 0; i < voices.size(); i++)
+	{
+		if(voices.getUnchecked(i)->getCurrentlyPlayingNote() >= 0) numPlayingVoices++;
 
-	// the read pointer will be pointing directly to the preload buffer of the sample sound
-	readBuffer = &s->getPreloadBuffer();
+		allVoicesAdd &= getStreamingVoice(i)->getMixMode() == StreamingSamplerVoice::AddToBuffer;
+	}
 
-	// If you hit this assert, you have to increase the buffer size of the preload buffer - it must be at least as big as
-	// the streaming buffers.
-	jassert(readBuffer->getNumSamples() >= bufferSize);
+	// The render threads add their buffers to the output, so a voice that overwrites the buffer must be rendered in this thread
+	const int numThreadsToUse = allVoicesAdd ? jmin(renderThreads.size(), numPlayingVoices / MIN_VOICES_PER_RENDER_THREAD - 1) : 0;
 
-	writeBuffer = &b1;
+	if(numThreadsToUse <= 0 || startSample + numSamples > renderThreads.getUnchecked(0)->buffer.getNumSamples())
+	{
+		if(batchRendering)	renderVoicesInBatches(outputBuffer, startSample, numSamples);
+		else				Synthesiser::renderVoices(outputBuffer, startSample, numSamples);
+
+		return;
+	}
+
+	nextVoiceToRender.set(0);
 
-	// Set the sampleposition to (1 * bufferSize) because the first buffer is the preload buffer
-	positionInSampleFile = bufferSize;
+	for(int i = 0; i < numThreadsToUse; i++)
+	{
+		RenderThread *t = renderThreads.getUnchecked(i);
 
-	lastPosition = 0.0;
+		t->startSample = startSample;
+		t->numSamples = numSamples;
+		t->state.set(RenderThread::jobAssigned);
+		t->wakeUp.signal();
+	}
 
+	// The audio thread renders its share directly into the output buffer
+	renderVoiceShare(outputBuffer, startSample, numSamples);
 
-	// The other buffer will be filled on the next free thread pool slot
-	if(!writeBufferIsBeingFilled)
+	for(int i = 0; i < numThreadsToUse; i++)
 	{
-		requestNewData();
+		RenderThread *t = renderThreads.getUnchecked(i);
+
+		// If the thread did not start yet, the job is taken back (all voices are already taken)
+		if(t->state.compareAndSetBool(RenderThread::idle, RenderThread::jobAssigned)) continue;
+
+		// The counter is at the end of the voice list, so this only waits for the voices that the thread renders right now
+		while(t->state.get() != RenderThread::idle) {}
+
+		for(int channel = 0; channel < jmin(2, outputBuffer.getNumChannels()); channel++)
+		{
+			FloatVectorOperations::add(outputBuffer.getWritePointer(channel, startSample), 
+									   t->buffer.getReadPointer(channel, startSample), numSamples);
+		}
 	}
-};
+}
 
-void SampleLoader::fillSampleBlockBuffer(AudioSampleBuffer &sampleBlockBuffer, int numSamples, int sampleIndex)
+void StreamingSampler::renderVoiceShare(AudioSampleBuffer &targetBuffer, int startSample, int numSamples)
 {
-	// Since the numSamples is only a estimate, the sampleIndex is used for the exact clock
-	readIndex = sampleIndex % bufferSize;
+	for(;;)
+	{
+		const int voiceIndex = ++nextVoiceToRender - 1;
 
-	jassert(sound != nullptr);
+		if(voiceIndex >= voices.size()) return;
 
-	if(readIndex + numSamples < bufferSize) // Copy all samples from the current read buffer
-	{
-		FloatVectorOperations::copy(sampleBlockBuffer.getWritePointer(0, 0), readBuffer->getReadPointer(0, readIndex), numSamples);
-		FloatVectorOperations::copy(sampleBlockBuffer.getWritePointer(1, 0), readBuffer->getReadPointer(1, readIndex), numSamples);
+		voices.getUnchecked(voiceIndex)->renderNextBlock(targetBuffer, startSample, numSamples);
 	}
+}
 
-	else // Copy the samples from the current read buffer, swap the buffers and continue reading
-	{
-		const int remainingSamples = bufferSize - readIndex;
+void StreamingSampler::renderVoicesInBatches(AudioSampleBuffer &outputBuffer, int startSample, int numSamples)
+{
+	StreamingSamplerVoice *batchVoices[VOICE_BATCH_SIZE];
+	int numInBatch = 0;
 
-		jassert(remainingSamples <= numSamples);
+	for(int i = 0; i < voices.size(); i++)
+	{
+		StreamingSamplerVoice *voice = getStreamingVoice(i);
 
-		const float *l = readBuffer->getReadPointer(0, readIndex);
-		const float *r = readBuffer->getReadPointer(1, readIndex);
+		if( ! voice->prepareBatchBlock(startSample, numSamples))
+		{
+			voice->renderNextBlock(outputBuffer, startSample, numSamples);
+			continue;
+		}
 
-		FloatVectorOperations::copy(sampleBlockBuffer.getWritePointer(0, 0), l, remainingSamples);
-		FloatVectorOperations::copy(sampleBlockBuffer.getWritePointer(1, 0), r, remainingSamples);
+		batchVoices[numInBatch++] = voice;
 
-		if(swapBuffers()) // Check if the buffer is currently used by the background thread
+		if(numInBatch == VOICE_BATCH_SIZE)
 		{
-			readIndex = 0;
+			renderBatch(batchVoices, numInBatch, outputBuffer, startSample, numSamples);
+			numInBatch = 0;
+		}
+	}
+
+	if(numInBatch > 0) renderBatch(batchVoices, numInBatch, outputBuffer, startSample, numSamples);
+}
 
-			const int numSamplesInNewReadBuffer = numSamples - remainingSamples;
+void StreamingSampler::renderBatch(StreamingSamplerVoice **batchVoices, int numVoices, AudioSampleBuffer &outputBuffer, int startSample, int numSamples)
+{
+	// The lanes are updated in short chunks, so the float positions stay accurate and a voice that 
+	// reaches the end of a loader block only leaves the batch for one chunk
+	const int chunkSize = 16;
 
-			FloatVectorOperations::copy(sampleBlockBuffer.getWritePointer(0, remainingSamples), readBuffer->getReadPointer(0, readIndex), numSamplesInNewReadBuffer);
-			FloatVectorOperations::copy(sampleBlockBuffer.getWritePointer(1, remainingSamples), readBuffer->getReadPointer(1, readIndex), numSamplesInNewReadBuffer);
+	BatchLane lanes[VOICE_BATCH_SIZE];
+	StreamingSamplerVoice *laneVoices[VOICE_BATCH_SIZE];
 
-			positionInSampleFile += bufferSize;
+	for(int offset = 0; offset < numSamples; offset += chunkSize)
+	{
+		const int numThisTime = jmin(chunkSize, numSamples - offset);
 
-			requestNewData();
-		}
-		else
+		float *outL = outputBuffer.getWritePointer(0, startSample + offset);
+		float *outR = outputBuffer.getWritePointer(1, startSample + offset);
+
+		int numLanes = 0;
+
+		for(int i = 0; i < numVoices; i++)
 		{
-			// Oops, The background thread was not quickly enough. Try to increase the preload / buffer size.   
-			jassertfalse;
+			StreamingSamplerVoice *voice = batchVoices[i];
+
+			if(voice->getBatchLane(numThisTime, lanes[numLanes]))	laneVoices[numLanes++] = voice;
+			else													voice->renderChunkDirectly(outL, outR, startSample + offset, numThisTime);
 		}
+
+		renderLanes(lanes, numLanes, outL, outR, numThisTime);
+
+		for(int i = 0; i < numLanes; i++) laneVoices[i]->advanceBatchLane(numThisTime);
 	}
-};
 
+	for(int i = 0; i < numVoices; i++) batchVoices[i]->finishBatchBlock(numSamples);
+}
 
-ThreadPoolJob::JobStatus SampleLoader::runJob()
+StreamingSampler::RenderThread::RenderThread(StreamingSampler &parent_, int maximumBlockSize):
+	Thread("StreamingSampler render thread"),
+	state(idle),
+	buffer(2, maximumBlockSize),
+	startSample(0),
+	numSamples(0),
+	parent(parent_)
 {
-	const double readStart = Time::highResolutionTicksToSeconds(Time::getHighResolutionTicks());
+	startThread(10);
+}
 
-	fillInactiveBuffer();
+StreamingSampler::RenderThread::~RenderThread()
+{
+	signalThreadShouldExit();
+	wakeUp.signal();
 
-	writeBufferIsBeingFilled = false;
+	stopThread(1000);
+}
 
-	const double readStop = Time::highResolutionTicksToSeconds(Time::getHighResolutionTicks());
-	const double readTime = (readStop - readStart);
-	const double timeSinceLastCall = readStop - lastCallToRequestData;
-	const double diskUsageThisTime =  readTime / timeSinceLastCall;
-	diskUsage = jmax(diskUsage, diskUsageThisTime);
-	lastCallToRequestData = readStart;
+void StreamingSampler::RenderThread::run()
+{
+	while( ! threadShouldExit())
+	{
+		wakeUp.wait(100);
 
-	return JobStatus::jobHasFinished;
+		if(state.compareAndSetBool(rendering, jobAssigned))
+		{
+			// The voices are added to the buffer, so it must be cleared first
+			buffer.clear(startSample, numSamples);
+
+			parent.renderVoiceShare(buffer, startSample, numSamples);
+
+			state.set(idle);
+		}
+	}
 }
 
-void SampleLoader::requestNewData()
+StreamingSampler::~StreamingSampler()
 {
-	writeBufferIsBeingFilled = true; // A poor man's mutex but gets the job done.
+	engine->unregisterSampler(this);
 
-#if(USE_BACKGROUND_THREAD)
+	// The voices use the thread and the buffer pool, so they must be deleted first
+	renderThreads.clear();
+	clearVoices();
 
-	// check if the background thread is already loading this sound
-	jassert(! backgroundPool->contains(this));
+	// The sounds are removed from the pool if no other sampler uses them
+	clearSounds();
+	engine->releaseUnusedSounds();
 
-	backgroundPool->addJob(this, false);
-#else
+	SharedStreamingEngine::release();
+}
 
-	// run the thread job synchronously
-	runJob();
+void StreamingSampler::setNumVoices(int numVoices)
+{
+	numVoicesToCreate = jmax(0, numVoices);
 
-#endif
-};
+	createVoices();
+}
 
-void SampleLoader::fillInactiveBuffer()
+void StreamingSampler::createVoices()
 {
-	if(sound != nullptr && sound->hasEnoughSamplesForBlock(bufferSize + positionInSampleFile))
+	const ScopedLock sl(lock);
+
+	clearVoices();
+	bufferPool = nullptr;
+
+	if(numVoicesToCreate == 0) return;
+
+	bufferPool = new StreamingBufferPool(getNumPoolSlots(), streamBufferSize);
+
+	for(int i = 0; i < numVoicesToCreate; i++)
 	{
-		sound->fillSampleBuffer(*writeBuffer, bufferSize, (int)positionInSampleFile);
+		StreamingSamplerVoice *v = new StreamingSamplerVoice(backgroundThread, bufferPool);
+
+		v->setLoaderBufferSize(streamBufferSize);
+		// The stream buffers are STREAM_BUFFER_SIZE_IN_BLOCKS callbacks long
+		v->setMaximumBlockSize(streamBufferSize / STREAM_BUFFER_SIZE_IN_BLOCKS);
+		v->setOfflineMode(offlineMode);
+		v->setNoteCounter(&noteCounter);
+
+		addVoice(v);
 	}
-};
-	
-bool SampleLoader::swapBuffers()
+}
+
+StreamingSamplerSound *StreamingSampler::loadSound(const File &file, const BigInteger &midiNotes, int rootNote)
+{
+	StreamingSamplerSound::Ptr sound = engine->getSound(file);
+
+	addSound(new MappedStreamingSound(sound, midiNotes, rootNote));
+
+	// Sounds that were removed from this sampler might be unused now
+	engine->releaseUnusedSounds();
+
+	engine->triggerPreloadAdaption();
+
+	return sound;
+}
+
+void StreamingSampler::prepareToPlay(double newSampleRate, int samplesPerBlock)
 {
-	if(readBuffer == &b1)
+	setCurrentPlaybackSampleRate(newSampleRate);
+
+	const int newStreamBufferSize = samplesPerBlock * STREAM_BUFFER_SIZE_IN_BLOCKS;
+
+	if(newStreamBufferSize != streamBufferSize || bufferPool == nullptr)
 	{
-		readBuffer = &b2;
-		writeBuffer = &b1;
+		streamBufferSize = newStreamBufferSize;
+
+		// The pool can't grow, so the voices are created again with a new pool
+		createVoices();
 	}
-	else // This condition will also be true if the read pointer points at the preload buffer
+
+	engine->reportStreamBufferSize(streamBufferSize);
+
+	if(renderThreads.size() > 0 && renderThreads.getUnchecked(0)->buffer.getNumSamples() < samplesPerBlock)
 	{
-		readBuffer = &b1;
-		writeBuffer = &b2;
+		setNumRenderThreads(renderThreads.size(), samplesPerBlock);
 	}
 
-	return writeBufferIsBeingFilled == false;
-};
+	engine->triggerPreloadAdaption();
+}
 
-// ==================================================================================================== StreamingSamplerVoice methods
+int StreamingSampler::getWantedPreloadSize(const StreamingSamplerSound *sound) const
+{
+	// As long as nothing was measured, the default preload size is used. The preload buffer must always be as big as the stream buffer.
+	const int latencySize = sound->getReadLatency() < 0.0 ? PRELOAD_SIZE : sound->getRecommendedPreloadSize();
 
-StreamingSamplerVoice::StreamingSamplerVoice(ThreadPool *pool):
-loader(pool)
+	return jmax(latencySize, getMinimumPreloadSize());
+}
+
+void StreamingSampler::addPreloadRequests(Array<SharedStreamingEngine::PreloadRequest> &requests) const
 {
-	pitchData = nullptr;
-};
+	// This runs on the adaption thread, so the sounds are copied while the sampler is locked. 
+	// Several mappings can share a sound, but it only counts once.
+	ReferenceCountedArray<StreamingSamplerSound> soundsToUpdate;
 
-void StreamingSamplerVoice::startNote (int midiNoteNumber, 
-									   float /*velocity*/, 
-									   SynthesiserSound* s, 
-									   int /*currentPitchWheelPosition*/)
+	{
+		const ScopedLock sl(lock);
+
+		for(int i = 0; i < sounds.size(); i++) soundsToUpdate.addIfNotAlreadyThere(getStreamingSound(i));
+	}
+
+	// Short samples are played from memory, so they don't take part in the budget
+	for(int i = soundsToUpdate.size() - 1; i >= 0; i--)
+	{
+		StreamingSamplerSound *sound = soundsToUpdate.getUnchecked(i);
+
+		if(sound->isEntirelyLoaded() || sound->getSampleLength() <= inMemoryLength)
+		{
+			if( ! sound->isEntirelyLoaded()) SharedStreamingEngine::addPreloadRequest(requests, sound, (int)sound->getSampleLength(), false);
+
+			soundsToUpdate.remove(i);
+		}
+	}
+
+	int64 wantedBytes = 0;
+	int64 loopBytes = 0;
+
+	for(int i = 0; i < soundsToUpdate.size(); i++)
+	{
+		const StreamingSamplerSound *sound = soundsToUpdate.getUnchecked(i);
+
+		// The octave versions and the start anchors have their own preload buffers with the same size
+		const int numBuffers = sound->getNumPreloadBuffers();
+
+		wantedBytes += (int64)getWantedPreloadSize(sound) * numBuffers * 2 * (int64)sizeof(float);
+
+		// The loop buffers stay in memory with every preload size, so they only reduce the budget
+		loopBytes += (int64)sound->getLoopMemoryUsage();
+	}
+
+	// The locked stream buffers and the mapped samples that are locked for zero copy streaming are charged against the budget too
+	int64 lockedBytes = bufferPool != nullptr ? (int64)bufferPool->getNumLockedBytes() : 0;
+
+	for(int i = 0; i < soundsToUpdate.size(); i++) lockedBytes += (int64)soundsToUpdate.getUnchecked(i)->getNumLockedFileBytes();
+	const int64 availableBytes = jmax((int64)0, preloadBudget - lockedBytes - loopBytes);
+
+	// If everything doesn't fit into the budget, all sounds get the same fraction of their wanted size
+	const double budgetRatio = wantedBytes > availableBytes ? (double)availableBytes / (double)wantedBytes : 1.0;
+
+	for(int i = 0; i < soundsToUpdate.size(); i++)
+	{
+		StreamingSamplerSound *sound = soundsToUpdate.getUnchecked(i);
+
+		const int newSize = jmax(getMinimumPreloadSize(), (int)(budgetRatio * (double)getWantedPreloadSize(sound)));
+
+		// The engine resizes the sound (a shared sound gets the biggest size that a sampler requests)
+		SharedStreamingEngine::addPreloadRequest(requests, sound, newSize, budgetRatio < 1.0);
+	}
+}
+
+size_t StreamingSampler::getPreloadMemoryUsage() const
 {
-	StreamingSamplerSound *sound = dynamic_cast<StreamingSamplerSound*>(s);
+	// Several mappings can share a sound, but its memory only counts once
+	Array<StreamingSamplerSound*> countedSounds;
+	size_t memoryUsage = 0;
+
+	for(int i = 0; i < sounds.size(); i++)
+	{
+		StreamingSamplerSound *sound = getStreamingSound(i);
 
-	loader.startNote(sound);
+		if(countedSounds.contains(sound)) continue;
 
-	jassert(sound != nullptr);
-	sound->wakeSound();
+		countedSounds.add(sound);
+		memoryUsage += sound->getActualPreloadSize();
+	}
 
-	voiceUptime = 0.0;
-	uptimeDelta = jmin(sound->getPitchFactor(midiNoteNumber), (double)MAX_SAMPLER_PITCH);
+	return memoryUsage;
 }
 
+double StreamingSampler::getDiskUsage()
+{
+	double diskUsage = 0.0;
+
+	for(int i = 0; i < voices.size(); i++) diskUsage += getStreamingVoice(i)->getDiskUsage();
 
-void StreamingSamplerVoice::renderNextBlock(AudioSampleBuffer &outputBuffer, int startSample, int numSamples)
+	return diskUsage;
+}
+
+void StreamingSampler::setMaxPolyphony(int newMaxPolyphony)
 {
-	const StreamingSamplerSound *sound = loader.getLoadedSound();
+	const int numSlots = getNumPoolSlots();
 
-	if(sound != nullptr)
+	maxPolyphony = jmax(1, newMaxPolyphony);
+	polyphonyLimit = maxPolyphony;
+
+	// The pool can't grow or shrink, so the voices are created again with a new pool
+	if(bufferPool != nullptr && numSlots != getNumPoolSlots()) createVoices();
+}
+
+double StreamingSampler::getStreamingLoad() const
+{
+	double load = 0.0;
+	int numStreamingVoices = 0;
+	int numWaitingVoices = 0;
+
+	for(int i = 0; i < voices.size(); i++)
 	{
+		StreamingSamplerVoice *v = getStreamingVoice(i);
 
-		const int pos = (int)voiceUptime;
+		if(v->getLoadedSound() == nullptr) continue;
 
-		double numSamplesUsed = voiceUptime - pos;
+		const SampleLoader &l = v->getLoader();
 
-		if(pitchData != nullptr)
+		if(l.isStreamingFromDisk())
 		{
-			for(int i = startSample; i < startSample + numSamples; ++i) 
-			numSamplesUsed += jmin(uptimeDelta * pitchData[i], (double)MAX_SAMPLER_PITCH);
+			numStreamingVoices++;
+
+			if(l.isReadingFromDisk()) numWaitingVoices++;
 		}
-		else
+
+		load = jmax(load, 1.0 - l.getBufferFillRatio(), l.getLatencyLoad());
+	}
+
+	if(numStreamingVoices > 0)
+	{
+		// The ratio of streaming voices that are waiting for the disk (the thread queue is shared with other samplers, 
+		// so only the requests of this sampler's voices are counted)
+		load = jmax(load, (double)numWaitingVoices / (double)numStreamingVoices);
+	}
+
+	return load;
+}
+
+void StreamingSampler::updatePolyphonyLimit(int numActiveVoices) const
+{
+	const double load = getStreamingLoad();
+
+	if(load > maxStreamingLoad)
+	{
+		// Don't allow more voices than the ones that are already struggling
+		polyphonyLimit = jlimit(1, maxPolyphony, jmin(polyphonyLimit, numActiveVoices));
+	}
+	else if(load < 0.5 * maxStreamingLoad)
+	{
+		// The disk has recovered, so the limit can slowly go back up
+		polyphonyLimit = jmin(maxPolyphony, polyphonyLimit + 1);
+	}
+}
+
+StreamingSamplerVoice *StreamingSampler::getVoiceToSteal(bool includeFadingVoices) const
+{
+	StreamingSamplerVoice *voiceToSteal = nullptr;
+	double highestScore = -1.0;
+
+	for(int i = 0; i < voices.size(); i++)
+	{
+		StreamingSamplerVoice *v = getStreamingVoice(i);
+
+		if(v->getCurrentlyPlayingNote() < 0) continue;
+
+		if(v->isFadingOut() && ! includeFadingVoices) continue;
+
+		// Released voices are the first candidates, then the quiet ones and the expensive ones. 
+		// The age decides if everything else is equal.
+		const double released = v->isFadingOut() ? 1.0 : 0.0;
+		const double quietness = 1.0 - (double)v->getVelocity();
+		const double cost = v->getStreamingCost() / (double)MAX_SAMPLER_PITCH;
+		const double age = 1.0 / (1.0 + (double)v->getNoteIndex());
+
+		const double score = 8.0 * released + 4.0 * quietness + 2.0 * cost + age;
+
+		if(score > highestScore)
 		{
-			for(int i = startSample; i < startSample + numSamples; i++)
-			numSamplesUsed += uptimeDelta;
+			highestScore = score;
+			voiceToSteal = v;
 		}
+	}
 
-		const int samplesToCopy = (int)(numSamplesUsed) + 2; // get a few more for linear interpolating
+	return voiceToSteal;
+}
+
+SynthesiserVoice* StreamingSampler::findFreeVoice(SynthesiserSound* soundToPlay, const bool stealIfNoneAvailable) const
+{
+	const ScopedLock sl(lock);
+
+	SynthesiserVoice *freeVoice = nullptr;
+	int numActiveVoices = 0;
+
+	for(int i = 0; i < voices.size(); i++)
+	{
+		StreamingSamplerVoice *v = getStreamingVoice(i);
 
-		if( ! sound->hasEnoughSamplesForBlock(pos + samplesToCopy) )
+		if(v->getCurrentlyPlayingNote() < 0)
 		{
-			resetVoice();
-			return;
+			if(freeVoice == nullptr && v->canPlaySound(soundToPlay)) freeVoice = v;
+		}
+		else if( ! v->isFadingOut()) // Voices that are fading out don't count
+		{
+			numActiveVoices++;
 		}
+	}
 
-		loader.fillSampleBlockBuffer(samplesForThisBlock, samplesToCopy, pos);
-	
-		const float *inL = samplesForThisBlock.getReadPointer(0);
-		const float *inR = samplesForThisBlock.getReadPointer(1);
+	updatePolyphonyLimit(numActiveVoices);
 
-		float *outL = outputBuffer.getWritePointer(0, startSample);
-		float *outR = outputBuffer.getWritePointer(1, startSample);
+	if(freeVoice != nullptr && numActiveVoices < polyphonyLimit) return freeVoice;
 
-		while (--numSamples >= 0)
-		{
-			const float indexFloat = (float)(voiceUptime - pos);
-			const int index = (int)(indexFloat);
+	if( ! stealIfNoneAvailable) return nullptr;
 
-			jassert((index + 1) <= samplesToCopy);
+	// If the polyphony limit is reached, a voice that is already fading out doesn't help
+	StreamingSamplerVoice *voiceToSteal = getVoiceToSteal(freeVoice == nullptr);
 
-			const float alpha = indexFloat - index;
-			const float invAlpha = 1.0f - alpha;
+	if(voiceToSteal == nullptr) return freeVoice;
 
-			float l = inL[index] * invAlpha + inL[index+1] * alpha;
-			float r = inR[index] * invAlpha + inR[index+1] * alpha;
+	if(freeVoice != nullptr)
+	{
+		// Crossfade: the stolen voice fades out while the new note starts on the free voice
+		const double sampleRateToUse = getSampleRate() > 0.0 ? getSampleRate() : 44100.0;
+		voiceToSteal->fadeOut((int)(stealFadeTimeMs * 0.001 * sampleRateToUse));
 
-#if OVERWRITE_BUFFER_WITH_VOICE_DATA
-			*outL++ = l;
-			*outR++ = r;
-#else
-			*outL++ += l;
-			*outR++ += r;	
-#endif
-			voiceUptime += uptimeDelta * (pitchData == nullptr ? 1.0 : (double)pitchData[startSample]);
-			++startSample;
-		}
+		return freeVoice;
 	}
-};
 
-// ==================================================================================================== StreamingSampler methods
+	// There is no voice left for a crossfade, so the voice will be stopped immediately
+	return voiceToSteal;
+}
 
@@ -62,18 +62,96 @@
 // This is the maximum value for sample pitch manipulation (this means 3 octaves, which should be more than enough
 #define MAX_SAMPLER_PITCH 8
 
+// The maximum amount of decimated octave versions of a sample (see StreamingSamplerSound::createOctaveVersions()).
+// 3 versions cover the whole pitch range up to MAX_SAMPLER_PITCH.
+#define MAX_OCTAVE_VERSIONS 3
+
 // This is the default preload size. I defined a pretty random value here, but you can change this dynamically.
 #define PRELOAD_SIZE 11000
 
 // Same as the preload size.
 #define BUFFER_SIZE_FOR_STREAM_BUFFERS 11000
 
+// The StreamingSampler loads samples up to this length (in samples) entirely into memory. Voices play these sounds directly
+// from memory without streaming (see SampleLoader::isPlayingFromMemory()). You can change this with StreamingSampler::setInMemoryLength().
+#define IN_MEMORY_SAMPLE_LENGTH 65536
+
+// If this is enabled, the stream buffer size and the preload size are adapted to the measured disk latency. The values
+// you set with setBufferSize() and setPreloadSize() are then used as upper limits until the first read operations are measured.
+#define USE_ADAPTIVE_STREAM_BUFFERS 1
+
+// The adaptive stream buffers will never get smaller than this (in samples), even if the disk is really fast.
+#define MIN_BUFFER_SIZE_FOR_STREAM_BUFFERS 2048
+
+// The amount of stream buffers per voice. A voice reads ahead as many buffers as its playback rate requires, but it 
+// always needs one buffer for the current read position.
+#define NUM_STREAM_BUFFERS 4
+
+// If this is enabled, the stream buffers store the samples interleaved (LRLR...) instead of two separate channels, so the 
+// interpolation of a stereo sample touches one cache line instead of two. The preload buffers stay planar.
+#define INTERLEAVED_STREAM_BUFFERS 0
+
+// The adaptive sizing makes sure that a stream buffer lasts this many times longer than the slowest measured read operation.
+#define STREAM_LATENCY_SAFETY_FACTOR 4.0
+
+// This is the default release time in milliseconds. The voice keeps streaming while it fades out after a note off. 
+// You can change this for every sound with StreamingSamplerSound::setReleaseTime().
+#define DEFAULT_RELEASE_TIME_MS 20.0
+
+// The default crossfade length of the loop in samples. The smpl chunk of a wave file has no crossfade information, 
+// so you can set the crossfade with StreamingSamplerSound::setLoopPoints().
+#define DEFAULT_LOOP_CROSSFADE_LENGTH 0
+
+// The maximum amount of read requests that can wait for the StreamingThread. Every SampleLoader can only have one pending 
+// request, so this must be bigger than the amount of voices.
+#define MAX_NUM_STREAMING_REQUESTS 1024
+
+// If this is enabled, all buffers that are read in the audio thread (the preload buffers, the loop buffers and the stream 
+// buffers) are locked in RAM, so the OS can't swap them out. On Linux, bigger buffers are also backed by huge pages if possible.
+// The locked memory is charged against the preload budget (see StreamingSampler::setPreloadBudget()).
+#define LOCK_AUDIO_MEMORY 0
+
+// If this is enabled, the preload buffers are stored in named shared memory, so several processes that play the same samples 
+// (eg. sandboxed plugin instances) share one copy of the preload data. This is only available on Linux and OSX.
+#define USE_SHARED_PRELOAD_MEMORY 0
+
+// If this is enabled, the voices read 32 bit float stereo files directly from the memory mapped file instead of copying 
+// the samples into the stream buffers. The audio thread must never fault in a page, so the mapped samples are locked in RAM 
+// as long as the sound exists and the blocks are only read without a copy if the lock succeeded. This needs LOCK_AUDIO_MEMORY 
+// and is only available on Linux and OSX.
+#define USE_ZERO_COPY_STREAMING 0
+
+// The StreamingSampler only wakes up a render thread for every this many playing voices, since waking up a thread for a few 
+// voices costs more than it saves.
+#define MIN_VOICES_PER_RENDER_THREAD 8
+
+// The amount of samples that a voice needs for a change of its gain or pan (the change is applied as a linear ramp).
+#define VOICE_GAIN_SMOOTHING_SAMPLES 256
+
+// The amount of voices that the batch renderer of the StreamingSampler renders at once (one voice per SIMD lane).
+#define VOICE_BATCH_SIZE 8
+
+// The StreamingSampler sets the size of the stream buffers to this many audio callback blocks, so the voices load new data 
+// about every STREAM_BUFFER_SIZE_IN_BLOCKS blocks.
+#define STREAM_BUFFER_SIZE_IN_BLOCKS 32
+
+// The buffer pool of the StreamingSampler has this many slots more than the maximum polyphony, so stolen and released 
+// voices can fade out while new notes start.
+#define NUM_FADE_OUT_STREAM_SLOTS 8
+
+// The interval in milliseconds in which the StreamingSampler adapts the preload buffers to the measured disk latency.
+#define PRELOAD_ADAPTION_INTERVAL_MS 1000
+
+// The default amount of memory (in bytes) that the StreamingSampler uses for the preload buffers of all sounds.
+#define DEFAULT_PRELOAD_BUDGET (256 * 1024 * 1024)
+
 // You can set this to 0, if you want to disable background threaded reading. The files will then be read directly in the audio thread,
 // which is not the smartest thing to do, but it comes to good use for debugging.
 #define USE_BACKGROUND_THREAD 1
 
 // By default, every voice adds its output to the supplied buffer. Depending on your architecture, it could be more practical to
-// set (overwrite) the buffer. In this case, set this to 1.
+// set (overwrite) the buffer. In this case, set this to 1. This is only the initial mix mode of the voices, you can change it
+// at runtime with StreamingSamplerVoice::setMixMode().
 #if STANDALONE
 #define OVERWRITE_BUFFER_WITH_VOICE_DATA 0
 #else
@@ -98,18 +176,206 @@ struct LoadingError
 	String errorDescription;
 };
 
-/** A SamplerSound which provides buffered disk streaming using memory mapped file access and a preloaded sample start. */
-class StreamingSamplerSound: public SynthesiserSound
+/** Keeps a memory region resident in RAM while this object exists.
+*
+*	If LOCK_AUDIO_MEMORY is enabled, it locks the pages of the region (mlock() / VirtualLock()) and advises the OS to use 
+*	huge pages where this is available. Only the pages that lie completely inside the region are locked (locks on a page 
+*	don't nest, so a page that is shared with another allocation could be unlocked too early). If the budget is exceeded 
+*	or the OS refuses the lock, the memory simply stays pageable.
+*/
+class ResidentMemoryLock
 {
 public:
 
-	/** Creates a new StreamingSamplerSound.
+	/** Locks the region. Don't call this from the audio thread. */
+	ResidentMemoryLock(const void *data, size_t numBytes);
+
+	/** Unlocks the region. */
+	~ResidentMemoryLock();
+
+	/** Returns the amount of bytes that were locked by this object. */
+	size_t getNumLockedBytes() const noexcept { return numLockedBytes; };
+
+	/** Checks if the whole range lies in the locked pages. */
+	bool containsRange(const void *data, size_t numBytes) const noexcept
+	{
+		return lockedData != nullptr && (const char*)data >= (const char*)lockedData && 
+			   (const char*)data + numBytes <= (const char*)lockedData + numLockedBytes;
+	};
+
+	/** Sets the maximum amount of memory that can be locked by all ResidentMemoryLocks (the default is DEFAULT_PRELOAD_BUDGET). 
+	*	StreamingSampler::setPreloadBudget() sets this too.
+	*/
+	static void setMemoryBudget(int64 maxNumBytes) noexcept { memoryBudget = maxNumBytes; };
+
+	/** Returns the maximum amount of memory that can be locked. */
+	static int64 getMemoryBudget() noexcept { return memoryBudget; };
+
+	/** Returns the amount of memory that is currently locked by all ResidentMemoryLocks. */
+	static int64 getTotalLockedBytes() noexcept { return totalLockedBytes.get(); };
+
+private:
+
+	JUCE_DECLARE_NON_COPYABLE(ResidentMemoryLock)
+
+	void *lockedData;
+	size_t numLockedBytes;
+
+	static int64 memoryBudget;
+	static Atomic<int64> totalLockedBytes;
+};
+
+/** A named shared memory segment that holds preloaded samples.
+*
+*	The segment is identified by a key (the file, its modification time and the format and range of the preloaded data), 
+*	so every process that preloads the same part of the same sample attaches to the same memory. The first process creates 
+*	and fills the segment, all others map it read-only. 
+*
+*	The lifetime is managed with a lock file in the temp directory: every user holds a shared lock, and the last user (the 
+*	one that gets an exclusive lock without waiting when it detaches) removes the segment. A second lock file is held only 
+*	while a segment is opened, checked or removed, so no process ever waits for the other users. A segment that is still 
+*	being filled by another user is not shared (the preload buffer uses private memory then). The lock files are never 
+*	deleted, since another process might have just opened them.
+*
+*	This only works if USE_SHARED_PRELOAD_MEMORY is enabled on Linux or OSX. Otherwise (or if anything fails) the segment
+*	is invalid and the preload buffer uses private memory.
+*/
+class SharedPreloadMemory
+{
+public:
+
+	/** Attaches to the segment or creates it. If the segment is new, other users can't attach until markAsFilled() is called. */
+	SharedPreloadMemory(const String &key, int numChannels, int numSamples);
+
+	/** Detaches from the segment and removes it if no other process uses it. */
+	~SharedPreloadMemory();
+
+	/** Checks if the segment could be mapped. */
+	bool isValid() const noexcept { return data != nullptr; };
+
+	/** Returns true if this object created the segment and must fill it. */
+	bool needsToBeFilled() const noexcept { return isCreator; };
+
+	/** Makes the segment read-only and lets other processes attach to it. */
+	void markAsFilled();
+
+	/** Returns the channel data (this can only be written until markAsFilled() is called). */
+	float** getChannelPointers() noexcept { return channels; };
+
+private:
+
+	JUCE_DECLARE_NON_COPYABLE(SharedPreloadMemory)
+
+	String segmentName;
+
+	void *data;
+	size_t numBytes;
+
+	int segmentHandle;
+	int lockHandle;
+	int creationLockHandle;
+
+	bool isCreator;
+
+	float *channels[2];
+};
+
+/** An AudioSampleBuffer that stays resident in RAM (see ResidentMemoryLock). 
+*
+*	This is used for every buffer that is read in the audio thread. Don't resize it, since the lock covers only the original data.
+*	If it is created with a SharedPreloadMemory, it uses the memory of the segment instead of its own allocation.
+*/
+class ResidentSampleBuffer: public AudioSampleBuffer
+{
+public:
+
+	/** Creates the buffer. If sharedMemory_ is not nullptr, the buffer takes ownership and refers to its data. */
+	ResidentSampleBuffer(int numChannels, int numSamples, SharedPreloadMemory *sharedMemory_=nullptr):
+		AudioSampleBuffer(numChannels, sharedMemory_ != nullptr ? 0 : numSamples),
+		sharedMemory(sharedMemory_),
+		memoryLock(getDataToLock(numChannels, numSamples), (size_t)numChannels * (size_t)numSamples * sizeof(float))
+	{};
+
+	/** Returns the amount of bytes that are locked in RAM. */
+	size_t getNumLockedBytes() const noexcept { return memoryLock.getNumLockedBytes(); };
+
+	/** Returns false if the buffer refers to a shared segment that was already filled by another process. */
+	bool needsToBeFilled() const noexcept { return sharedMemory == nullptr || sharedMemory->needsToBeFilled(); };
+
+	/** Call this after the buffer was filled, so other processes can use the shared segment. */
+	void markAsFilled() { if(sharedMemory != nullptr) sharedMemory->markAsFilled(); };
+
+private:
+
+	/** Points the buffer to the shared memory (if there is one) and returns the data. */
+	const float *getDataToLock(int numChannels, int numSamples)
+	{
+		if(sharedMemory != nullptr) setDataToReferTo(sharedMemory->getChannelPointers(), numChannels, numSamples);
+
+		return getReadPointer(0);
+	};
+
+	ScopedPointer<SharedPreloadMemory> sharedMemory;
+
+	ResidentMemoryLock memoryLock;
+};
+
+/** Converts the raw PCM data of a memory mapped wave file into the planar float buffers of the streaming engine.
+*
+*	MemoryMappedAudioFormatReader::read() converts and deinterleaves every sample in a generic loop. These kernels convert
+*	a whole range of 16 bit, packed 24 bit, 32 bit integer or 32 bit float data (mono or stereo) with SIMD instructions. 
+*	The best kernels for the CPU are selected at the first call (AVX2 or SSE4.1 on x86, NEON on ARM and a scalar loop 
+*	everywhere else).
+*/
+class PcmDecoder
+{
+public:
+
+	/** The sample formats that can be decoded. */
+	enum Format
+	{
+		Int16 = 0,
+		Int24,
+		Int32,
+		Float32,
+		numFormats,
+		Unsupported = numFormats
+	};
+
+	/** Returns the format of the reader or Unsupported if it can't be decoded (eg. 8 bit or more than two channels). */
+	static Format getFormat(const AudioFormatReader &reader) noexcept;
+
+	/** Returns the size of one sample in bytes. */
+	static int getBytesPerSample(Format format) noexcept { return format == Int16 ? 2 : (format == Int24 ? 3 : 4); };
+
+	/** Converts interleaved little endian frames into the two destination channels.
 	*
-	*	@param fileToLoad a stereo wave file that is read as memory mapped file.
-	*	@param midiNotes the note map
-	*	@param midiNoteForNormalPitch the root note
+	*	@param format the sample format (it must not be Unsupported).
+	*	@param numChannels 1 or 2. Mono data is written to both destination channels.
+	*	@param source the first frame.
 	*/
-	StreamingSamplerSound(const File &fileToLoad, BigInteger midiNotes, int midiNoteForNormalPitch);
+	static void decode(Format format, int numChannels, const void *source, float *destL, float *destR, int numFrames) noexcept;
+
+	/** Returns the name of the instruction set that is used by the kernels. */
+	static const char *getInstructionSetName() noexcept;
+};
+
+class StreamingSamplerSound;
+
+/** The note mapping of a StreamingSamplerSound.
+*
+*	A StreamingSamplerSound is its own mapping. The StreamingSampler plays the shared sounds of the SharedStreamingEngine 
+*	with a MappedStreamingSound, so samplers with different mappings of the same file share the sample data. 
+*	The StreamingSamplerVoice can play both.
+*/
+class StreamingSoundMapping: public SynthesiserSound
+{
+public:
+
+	StreamingSoundMapping(const BigInteger &midiNotes_, int rootNote_):
+		rootNote(rootNote_),
+		midiNotes(midiNotes_)
+	{};
 
 	/** Checks if the note is mapped to the supplied note number. */
 	bool appliesToNote(const int midiNoteNumber) override { return midiNotes[midiNoteNumber]; };
@@ -120,39 +386,350 @@ public:
 	/** Returns the pitch factor for the note number. */
 	double getPitchFactor(int noteNumberToPitch) const { return pow(2.0, (noteNumberToPitch - rootNote) / 12.0); };
 
+	/** Returns the pitch factor of the highest mapped note (limited to MAX_SAMPLER_PITCH). */
+	double getMaximumPitchFactor() const { return jmin(getPitchFactor(midiNotes.getHighestBit()), (double)MAX_SAMPLER_PITCH); };
+
+	/** Returns the sound that contains the sample data. */
+	virtual StreamingSamplerSound *getStreamingSound() noexcept = 0;
+
+	/** The root note of the sample. If the sample is pitched, this note number plays back the sample with the 
+		original samplerate, but there is a limit of three octaves up to protect the streaming (I can't think of 
+		a musical useful purpose of transposing a sound more than 3 octaves, but you can change SAMPLER_MAX_PITCH
+		to allow larger values. */
+	int rootNote;
+
+	/** The note mapping of the sound (same functionality as SamplerSound) */
+	BigInteger midiNotes;
+};
+
+/** A SamplerSound which provides buffered disk streaming using memory mapped file access and a preloaded sample start. */
+class StreamingSamplerSound: public StreamingSoundMapping
+{
+public:
+
+	/** The loop region of the sample.
+	*
+	*	The whole loop (with the crossfade already applied to its end) is held in memory, so a looping voice never reads 
+	*	the loop from disk again.
+	*/
+	struct LoopData: public ReferenceCountedObject
+	{
+		LoopData(int64 loopStart_, int numSamples):
+			loopStart(loopStart_),
+			buffer(2, numSamples)
+		{};
+
+		typedef ReferenceCountedObjectPtr<LoopData> Ptr;
+
+		/** Returns the position in the loop buffer for a position in the stream (which must be after the loop start). */
+		int getLoopPosition(int64 streamPosition) const noexcept
+		{
+			jassert(streamPosition >= loopStart);
+			return (int)((streamPosition - loopStart) % (int64)buffer.getNumSamples());
+		};
+
+		const int64 loopStart;
+		ResidentSampleBuffer buffer;
+	};
+
+	/** The preloaded start of the sample.
+	*
+	*	It is reference counted, so a new preload buffer can be swapped in while the SampleLoaders still read from the old one.
+	*	The sound keeps the old buffers until no SampleLoader references them, so they are never deleted in the audio thread.
+	*
+	*	If the sound is looped, the buffer contains the start of the stream (the loop is already unrolled) and the loop 
+	*	data that was used to fill it. If the sound has start anchors, every anchor has its own preload buffer with the same size.
+	*/
+	struct PreloadData: public ReferenceCountedObject
+	{
+		PreloadData(int numSamples, SharedPreloadMemory *sharedMemory=nullptr):
+			buffer(2, numSamples, sharedMemory),
+			containsEntireSample(false)
+		{};
+
+		typedef ReferenceCountedObjectPtr<PreloadData> Ptr;
+
+		/** Returns the amount of anchors (the start of the sample is always the first anchor). */
+		int getNumAnchors() const noexcept { return anchorBuffers.size() + 1; };
+
+		/** Returns the size of the preload buffers of all anchors in bytes (without the loop). */
+		size_t getMemoryUsage() const noexcept { return (size_t)buffer.getNumSamples() * getNumAnchors() * 2 * sizeof(float); };
+
+		/** Returns the stream position of the anchor. */
+		int64 getAnchorPosition(int anchorIndex) const noexcept 
+		{ 
+			return anchorIndex == 0 ? 0 : anchorPositions[anchorIndex - 1]; 
+		};
+
+		/** Returns the preloaded samples of the anchor. */
+		const AudioSampleBuffer &getAnchorBuffer(int anchorIndex) const noexcept 
+		{ 
+			return anchorIndex == 0 ? buffer : *anchorBuffers.getUnchecked(anchorIndex - 1); 
+		};
+
+		/** Returns the index of the last anchor before the given stream position. */
+		int getAnchorIndex(int64 streamPosition) const noexcept
+		{
+			int anchorIndex = 0;
+
+			while(anchorIndex + 1 < getNumAnchors() && getAnchorPosition(anchorIndex + 1) <= streamPosition) anchorIndex++;
+
+			return anchorIndex;
+		};
+
+		/** Returns the position in the sample file for the given position in the stream. */
+		int64 getFilePosition(int64 streamPosition) const noexcept
+		{
+			if(loop == nullptr || streamPosition < loop->loopStart) return streamPosition;
+
+			return loop->loopStart + loop->getLoopPosition(streamPosition);
+		};
+
+		ResidentSampleBuffer buffer;
+		LoopData::Ptr loop;
+
+		// true if the buffer contains the whole sample and the sound is not looped (so a voice never needs to stream)
+		bool containsEntireSample;
+
+		// the additional start anchors (sorted by their position)
+		Array<int64> anchorPositions;
+		OwnedArray<ResidentSampleBuffer> anchorBuffers;
+	};
+
+	typedef ReferenceCountedObjectPtr<StreamingSamplerSound> Ptr;
+
+	/** Creates a new StreamingSamplerSound.
+	*
+	*	@param fileToLoad a stereo wave file that is read as memory mapped file.
+	*	@param midiNotes the note map
+	*	@param midiNoteForNormalPitch the root note
+	*/
+	StreamingSamplerSound(const File &fileToLoad, BigInteger midiNotes, int midiNoteForNormalPitch);
+
+	/** Returns this sound (it is its own mapping). */
+	StreamingSamplerSound *getStreamingSound() noexcept override { return this; };
+
 	/** Set the preload size. 
 	*
 	*	You can also tell the sound to load everything into memory by calling loadEntireSample()
+	*
+	*	The new buffer is allocated and filled in the calling thread and then swapped in, so you can call this while the sound is
+	*	playing (but never from the audio thread). Voices that are already playing keep the old buffer until their note ends.
 	*/
 	void setPreloadSize(int newPreloadSizeInSamples);
 
+	/** Deletes all old preload buffers that are not used by a SampleLoader anymore (including the ones of the octave versions). 
+	*
+	*	This is called by setPreloadSize() and by the adaption thread of the SharedStreamingEngine every 
+	*	PRELOAD_ADAPTION_INTERVAL_MS milliseconds, so the memory of the old buffers is freed soon after the last voice stops.
+	*	If you use the sound without a StreamingSampler, call it from time to time (not from the audio thread).
+	*/
+	void releaseUnusedPreloadBuffers();
+
 	/** Tell the sound to load everything into memory. */
 	void loadEntireSample() {setPreloadSize(-1);};
 
-	/** Returns the size of the preload buffer in bytes. You can use this method to check how much memory the sound uses. */
+	/** Returns the current preload size in samples. */
+	int getPreloadSize() const noexcept { return preloadSize; };
+
+	/** Returns the length of the sample file in samples. */
+	int64 getSampleLength() const noexcept { return memoryReader->getMappedSection().getLength(); };
+
+	/** Checks if the entire sample is loaded into memory. */
+	bool isEntirelyLoaded() const noexcept { return preloadSize >= getSampleLength(); };
+
+	/** Returns the preload size that is needed for the measured disk latency and the highest playback rate of the sound.
+	*
+	*	As long as there was no read operation, this returns the current preload size.
+	*/
+	int getRecommendedPreloadSize() const;
+
+	/** Returns the slowest recent read operation in seconds (including the time the request waited in the thread pool) or -1.0 if nothing was read yet. */
+	double getReadLatency() const noexcept 
+	{ 
+		SpinLock::ScopedLockType sl(latencyLock);
+		return readLatency; 
+	};
+
+	/** Returns the highest playback rate this sound can be played with.
+	*
+	*	This is the pitch factor of the highest mapped note (limited to MAX_SAMPLER_PITCH) or the highest rate of another 
+	*	mapping or the highest rate that was reported by a SampleLoader if it is bigger.
+	*/
+	double getMaximumPlaybackRate() const noexcept;
+
+	/** Tells the sound the highest pitch factor of another mapping (see MappedStreamingSound). */
+	void reportMappedPlaybackRate(double playbackRate) noexcept;
+
+	/** Returns the sample rate of the file. */
+	double getSampleRate() const noexcept { return sampleRate; };
+
+	/** Sets the loop points.
+	*
+	*	The loop points are read from the smpl chunk of the wave file when the sound is loaded, but you can change them with this
+	*	method. The loop region is loaded into memory and the crossfade is applied to the end of the loop (it is faded into the 
+	*	samples before the loop start). Like setPreloadSize() this can be called while the sound is playing, but not from the 
+	*	audio thread. Voices that are already playing keep the old loop until their note ends.
+	*
+	*	@param loopStart the first sample of the loop.
+	*	@param loopEnd the sample after the last sample of the loop. If it is not bigger than loopStart, the loop is disabled.
+	*	@param crossfadeLength the length of the crossfade in samples.
+	*/
+	void setLoopPoints(int64 loopStart, int64 loopEnd, int crossfadeLength=DEFAULT_LOOP_CROSSFADE_LENGTH);
+
+	/** Checks if the sound is looped. */
+	bool isLoopEnabled() const noexcept { return loopEnd > loopStart; };
+
+	/** Returns the first sample of the loop. */
+	int64 getLoopStart() const noexcept { return loopStart; };
+
+	/** Returns the sample after the last sample of the loop. */
+	int64 getLoopEnd() const noexcept { return loopEnd; };
+
+	/** Returns the length of the loop crossfade in samples. */
+	int getLoopCrossfade() const noexcept { return loopCrossfade; };
+
+	/** Sets the positions where a voice can start without loading the entire sample.
+	*
+	*	Every anchor gets its own preload buffer (with the preload size), so a note that starts with an offset begins at 
+	*	the last anchor before the offset and the SampleLoader streams the rest of the sample from there. The start of the 
+	*	sample is always an anchor. Like setPreloadSize() this can be called while the sound is playing, but not from the audio thread.
+	*
+	*	@param anchorPositions the positions in samples. Positions outside the sample are ignored.
+	*/
+	void setStartAnchors(const Array<int64> &anchorPositions);
+
+	/** Returns the additional start anchors (without the start of the sample). */
+	const Array<int64> &getStartAnchors() const noexcept { return startAnchors; };
+
+	/** Sets the start offset that is controlled by the velocity.
+	*
+	*	A note with velocity 1.0 starts at the beginning of the sample, softer notes start later (up to maxOffset samples for velocity 0.0).
+	*	You should add start anchors for this range with setStartAnchors().
+	*/
+	void setVelocityStartOffset(int64 maxOffset) noexcept { velocityStartOffset = jmax<int64>(0, maxOffset); };
+
+	/** Returns the start offset in samples for the given velocity. */
+	int64 getStartOffsetForVelocity(float velocity) const noexcept 
+	{ 
+		return (int64)((1.0f - jlimit(0.0f, 1.0f, velocity)) * (float)velocityStartOffset); 
+	};
+
+	/** Sets the release time in milliseconds. 
+	*
+	*	If a note off allows a tail off, the voice fades out over this time and keeps streaming until the fade is finished.
+	*	Set it to 0.0 to stop the voice immediately.
+	*/
+	void setReleaseTime(double newReleaseTimeMilliseconds) noexcept 
+	{ 
+		releaseTimeMs = jmax(0.0, newReleaseTimeMilliseconds); 
+
+		for(int i = 0; i < octaveVersions.size(); i++) octaveVersions.getUnchecked(i)->setReleaseTime(releaseTimeMs);
+	};
+
+	/** Returns the release time in milliseconds. */
+	double getReleaseTime() const noexcept { return releaseTimeMs; };
+
+	/** Returns the size of the preload buffers (and the loop buffer) in bytes. You can use this method to check how much memory the sound uses. 
+	*
+	*	This includes the old preload buffers that are still used by playing voices (see releaseUnusedPreloadBuffers()).
+	*/
 	size_t getActualPreloadSize() const
 	{
-		return (size_t)(preloadSize *preloadBuffer.getNumChannels()) * sizeof(float);
+		const int64 loopSize = isLoopEnabled() ? loopEnd - loopStart : 0;
+
+		size_t octaveVersionSize = 0;
+
+		for(int i = 0; i < octaveVersions.size(); i++) octaveVersionSize += octaveVersions.getUnchecked(i)->getActualPreloadSize();
+
+		return (size_t)(((int64)preloadSize * getPreloadData()->getNumAnchors() + loopSize) * 2) * sizeof(float) + octaveVersionSize
+				+ getRetiredPreloadSize();
 	}
 
+	/** Creates decimated octave versions of the sample for highly pitched notes.
+	*
+	*	Every version has half the sample rate of the previous one and is stored next to the sample as 32 bit float wave file 
+	*	("Sample_oct1.wav", "Sample_oct2.wav", ...). Existing files are only generated again if the sample is newer. A voice 
+	*	streams the version with the lowest rate that is not below its playback rate, so a note that is pitched up by two octaves 
+	*	reads a quarter of the samples and the decimation filter removes the content that would alias. 
+	*
+	*	The loop points, the start anchors, the release time and the preload size are applied to all versions. The versions
+	*	are deleted and created again, so call this before the sound is played (and never from the audio thread).
+	*	This throws a LoadingError if a version can't be written or loaded.
+	*
+	*	@param numOctaves the amount of versions (up to MAX_OCTAVE_VERSIONS). 0 removes all versions.
+	*/
+	void createOctaveVersions(int numOctaves);
+
+	/** Returns the amount of octave versions. */
+	int getNumOctaveVersions() const noexcept { return octaveVersions.size(); };
+
+	/** Returns the octave version that should be streamed for the playback rate (0 is the sample itself). */
+	int getOctaveForPlaybackRate(double playbackRate) const noexcept
+	{
+		int octave = 0;
+
+		while(octave < octaveVersions.size() && playbackRate >= (double)(2 << octave)) octave++;
+
+		return octave;
+	};
+
+	/** Returns the amount of preload buffers of the sound and its octave versions (one for every start anchor). 
+	*
+	*	All of them have the preload size, so this is the amount of memory that one sample of the preload size costs.
+	*/
+	int getNumPreloadBuffers() const;
+
+	/** Returns the bytes of the in-memory loop buffers of the sound and its octave versions. 
+	*
+	*	The loop buffer doesn't depend on the preload size, so it is charged against the preload budget as it is.
+	*/
+	size_t getLoopMemoryUsage() const;
+
+	/** Returns the bytes of the mapped files of the sound and its octave versions that are locked for zero copy streaming. */
+	size_t getNumLockedFileBytes() const;
+
+	/** Returns the sound for the octave version (0 returns this sound). */
+	StreamingSamplerSound *getOctaveVersion(int octave) noexcept
+	{
+		return octave == 0 ? this : octaveVersions.getUnchecked(octave - 1);
+	};
+
 	/** Gets the sound into active memory.
 	*
-	*	This is a wrapper around MemoryMappedAudioFormatReader::touchSample(), and I didn't check if it is necessary. 
+	*	This is a wrapper around MemoryMappedAudioFormatReader::touchSample(). It might cause a page fault, so don't call 
+	*	this from the audio thread (the voices don't call it anymore, since they read the start of the sample from the preload buffer).
 	*/
 	void wakeSound() { memoryReader->touchSample(0); };
 
 	/** Checks if the file is mapped and has enough samples.
 	*
-	*	Call this before you call fillSampleBuffer() to check if the audio file has enough samples.
+	*	Call this before you call fillSampleBuffer() to check if the audio file has enough samples. A looped sound never runs out of samples.
+	*
+	*	@param maxSampleIndexInStream the highest sample index of the stream (if the sound is looped, this is not the position in the file).
 	*/
-	bool hasEnoughSamplesForBlock(int64 maxSampleIndexInFile) const;
+	bool hasEnoughSamplesForBlock(int64 maxSampleIndexInStream) const;
 
-	/** Returns read only access to the preload buffer.
+	/** Returns a pointer to the interleaved samples in the mapped file if the range can be read without a copy.
+	*
+	*	This only works for 32 bit float stereo files (the octave versions are always written in this format) if 
+	*	USE_ZERO_COPY_STREAMING is enabled. The range must be before the loop and inside the pages that are locked while the 
+	*	sound exists, so the audio thread can read them later without a page fault. Don't call this from the audio thread.
+	*
+	*	@return the left sample of the first frame (the right sample follows, so the stride is 2) or nullptr if the samples must be copied.
+	*/
+	const float *getResidentMappedSamples(int64 streamPosition, int numSamples, const PreloadData &data) const;
+
+	/** Returns a reference to the current preload buffer.
 	*
 	*	This is used by the SampleLoader class to fetch the samples from the preloaded buffer until the disk streaming
-	*	thread fills the other buffer.
+	*	thread fills the other buffer. This is real time safe (it only locks a SpinLock for swapping the pointer).
 	*/
-	const AudioSampleBuffer &getPreloadBuffer() const {return preloadBuffer;};
+	PreloadData::Ptr getPreloadData() const noexcept
+	{
+		SpinLock::ScopedLockType sl(preloadLock);
+		return currentPreload;
+	};
 
 
 	/** The wave file that contains the sample data. It is assumed to be stereo and 44.1kHz 
@@ -160,15 +737,6 @@ public:
 	*	This file will be memory mapped and read from during playback by a StreamingSamplerVoice and its SamplerLoader
 	*/
 	const String fileName;
-
-	/** The root note of the sample. If the sample is pitched, this note number plays back the sample with the 
-		original samplerate, but there is a limit of three octaves up to protect the streaming (I can't think of 
-		a musical useful purpose of transposing a sound more than 3 octaves, but you can change SAMPLER_MAX_PITCH
-		to allow larger values. */
-	int rootNote;
-
-	/** The note mapping of the sound (same functionality as SamplerSound) */
-	BigInteger midiNotes;
 	
 private:
 
@@ -178,82 +746,618 @@ private:
 	*
 	*	It copies the samples either from the preload buffer or reads it directly from the file, so don't call this method from the 
 	*	audio thread, but use the SampleLoader class which handles the background thread stuff.
+	*
+	*	@param data the preload data that the SampleLoader uses for the current note (it also defines the loop).
+	*/
+	void fillSampleBuffer(AudioSampleBuffer &sampleBuffer, int samplesToCopy, int64 uptime, const PreloadData &data) const;
+
+	/** Reads a range of the stream. 
+	*
+	*	The samples after the loop start are copied from the loop buffer, everything before is read from the file. 
+	*	If the sound is not looped, the samples after the end of the file are cleared.
+	*/
+	void readFromStream(AudioSampleBuffer &sampleBuffer, int samplesToCopy, int64 streamPosition, const LoopData *loop) const;
+
+	/** Returns the size of the old preload buffers that are still used by a SampleLoader in bytes. */
+	size_t getRetiredPreloadSize() const;
+
+	/** Loads the loop region into memory and applies the crossfade. Returns nullptr if the loop is disabled. */
+	LoopData::Ptr createLoopData() const;
+
+	/** Returns the shared memory for the preloaded range or nullptr if USE_SHARED_PRELOAD_MEMORY is disabled or the segment can't be mapped. */
+	SharedPreloadMemory *createSharedPreloadMemory(int64 streamPosition, int numSamples) const;
+
+	/** Reads the preloaded range into the buffer unless another process already filled its shared memory. */
+	void fillPreloadBuffer(ResidentSampleBuffer &buffer, int numSamples, int64 streamPosition) const;
+
+	/** Reads a range of the file into the buffer.
+	*
+	*	If the format is supported by the PcmDecoder, the mapped data is converted directly. Otherwise (or if the range is 
+	*	not completely inside the file) it is read with MemoryMappedAudioFormatReader::read().
 	*/
-	void fillSampleBuffer(AudioSampleBuffer &sampleBuffer, int samplesToCopy, int uptime) const;
+	void readFromFile(AudioSampleBuffer &buffer, int startSample, int numSamples, int64 filePosition) const;
+
+	/** Creates an octave version of the parent with the file of the decimated sample. 
+	*
+	*	The version gets the (scaled) loop points, start anchors, release time and preload size of the parent before its 
+	*	preload buffers are filled, so they are only read once.
+	*/
+	StreamingSamplerSound(const File &versionFile, const StreamingSamplerSound &parent, int octave);
+
+	/** Maps the file and reads the format. This throws a LoadingError if the file can't be mapped. */
+	void mapFile(const File &fileToLoad);
+
+	/** Fills new preload buffers with the given size (-1 loads the entire sample) and swaps them in. 
+	*
+	*	The octave versions are only filled again if their size changes or if refillOctaveVersions is true.
+	*/
+	void fillPreloadBuffers(int newPreloadSize, bool refillOctaveVersions);
+
+	/** Sets the loop points and loads the loop without filling the preload buffers. */
+	void applyLoopPoints(int64 newLoopStart, int64 newLoopEnd, int crossfadeLength);
+
+	/** Sets the start anchors without filling the preload buffers. */
+	void applyStartAnchors(const Array<int64> &anchorPositions);
+
+	/** Writes a version of the sample with the half sample rate (low pass filtered) to the file. */
+	void writeDecimatedVersion(const File &targetFile) const;
+
+	/** This is called by the SampleLoader whenever a read operation is finished.
+	*
+	*	It holds the peak latency and lets it decay slowly, so a single fast read does not shrink the buffers.
+	*/
+	void reportReadLatency(double latencyInSeconds, double playbackRate) const;
 
 	friend class SampleLoader;
 
-	AudioSampleBuffer preloadBuffer;	
+	PreloadData::Ptr currentPreload;
+	ReferenceCountedArray<PreloadData> retiredPreloads;
+
+	SpinLock preloadLock;
+	CriticalSection reconfigurationLock;
+
 	double sampleRate;
 	ScopedPointer<MemoryMappedAudioFormatReader> memoryReader;
 
+	// The samples of the mapped file that the voices read without a copy (this is unlocked before the file is unmapped)
+	ScopedPointer<ResidentMemoryLock> mappedFileLock;
+	PcmDecoder::Format decoderFormat;
+
 	int preloadSize;
 
+	double releaseTimeMs;
+
+	int64 loopStart;
+	int64 loopEnd;
+	int loopCrossfade;
+	LoopData::Ptr currentLoop;
+
+	Array<int64> startAnchors;
+	int64 velocityStartOffset;
+
+	// The decimated versions (the first one has the half sample rate)
+	ReferenceCountedArray<StreamingSamplerSound> octaveVersions;
+
+	// These are written by the background thread, so they must be mutable (and they are only accessed with the latencyLock)
+	mutable SpinLock latencyLock;
+	mutable double readLatency;
+	mutable double observedPlaybackRate;
+
+	// The highest pitch factor of the other mappings (also accessed with the latencyLock)
+	double mappedPlaybackRate;
+
+};
+
+/** A note mapping for a shared StreamingSamplerSound.
+*
+*	The SharedStreamingEngine pools the sounds by their file, so the StreamingSampler adds a MappedStreamingSound with its 
+*	own mapping for every loaded sound. The mapping holds a reference to the sound.
+*/
+class MappedStreamingSound: public StreamingSoundMapping
+{
+public:
+
+	MappedStreamingSound(StreamingSamplerSound *sound_, const BigInteger &midiNotes_, int rootNote_):
+		StreamingSoundMapping(midiNotes_, rootNote_),
+		sound(sound_)
+	{
+		// The preload size of the sound depends on the highest playback rate of all mappings
+		sound->reportMappedPlaybackRate(getMaximumPitchFactor());
+	};
+
+	/** Returns the shared sound. */
+	StreamingSamplerSound *getStreamingSound() noexcept override { return sound; };
+
+private:
+
+	StreamingSamplerSound::Ptr sound;
+
+	JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(MappedStreamingSound)
+};
+
+/** A preallocated arena for the stream buffers of all voices.
+*
+*	If you pass a pool to the StreamingSamplerVoice, its SampleLoader takes its stream buffers from this pool when a note 
+*	starts and gives them back when the voice stops, so the memory only scales with the amount of voices that are actually 
+*	playing. Acquiring and releasing a slot only uses a SpinLock and never allocates, so it is safe to do this in the audio thread.
+*/
+class StreamingBufferPool
+{
+public:
+
+	/** Creates a pool and allocates all stream buffers.
+	*
+	*	@param maxNumActiveVoices the amount of voices that can stream at the same time. If the pool runs out of slots, the voice will not be started.
+	*	@param bufferSizeInSamples the maximum buffer size of the SampleLoaders that use this pool.
+	*/
+	StreamingBufferPool(int maxNumActiveVoices, int bufferSizeInSamples);
+
+	/** Returns the index of a free slot or -1 if every slot is used. */
+	int acquireSlot() noexcept;
+
+	/** Gives the slot back to the pool. */
+	void releaseSlot(int slotIndex) noexcept;
+
+	/** Returns the start of the NUM_STREAM_BUFFERS stream buffers of the slot for the given channel. */
+	float *getSlotData(int slotIndex, int channel) const noexcept
+	{
+		jassert(isPositiveAndBelow(slotIndex, numSlots));
+		return arena + (size_t)(2 * slotIndex + channel) * getSlotSizePerChannel();
+	};
+
+	/** Returns the size of one stream buffer. */
+	int getBufferSize() const noexcept { return bufferSize; };
+
+	/** Returns the amount of slots that are currently not used. */
+	int getNumFreeSlots() const noexcept { return numFreeSlots; };
+
+	/** Returns the size of the arena in bytes. */
+	size_t getMemoryUsage() const noexcept { return (size_t)numSlots * 2 * getSlotSizePerChannel() * sizeof(float); };
+
+	/** Returns the amount of bytes of the arena that are locked in RAM (see LOCK_AUDIO_MEMORY). */
+	size_t getNumLockedBytes() const noexcept { return arenaLock != nullptr ? arenaLock->getNumLockedBytes() : 0; };
+
+private:
+
+	size_t getSlotSizePerChannel() const noexcept { return (size_t)bufferSize * NUM_STREAM_BUFFERS; };
+
+	JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(StreamingBufferPool)
+
+	SpinLock lock;
+
+	HeapBlock<float> arena;
+	ScopedPointer<ResidentMemoryLock> arenaLock;
+	HeapBlock<int> freeSlots;
+
+	int numSlots;
+	int numFreeSlots;
+	int bufferSize;
+};
+
+/** A counting semaphore that wakes up a waiting thread without taking a lock.
+*
+*	A WaitableEvent locks a mutex in signal(), so the audio thread could wait for a thread that holds it. This uses the 
+*	semaphore of the OS instead (sem_post() on Linux, semaphore_signal() on OSX and ReleaseSemaphore() on Windows), which 
+*	only enters the kernel if a thread is waiting. If the semaphore can't be created, wait() simply sleeps for the timeout.
+*/
+class WakeUpSemaphore
+{
+public:
+
+	WakeUpSemaphore();
+
+	~WakeUpSemaphore();
+
+	/** Wakes up the waiting thread (or the next call to wait() returns immediately). This is safe to call from the audio thread. */
+	void signal() noexcept;
+
+	/** Waits until signal() is called or the timeout is over. Returns true if it was signalled. */
+	bool wait(int timeoutMilliseconds) noexcept;
+
+private:
+
+	JUCE_DECLARE_NON_COPYABLE(WakeUpSemaphore)
+
+	void *handle;
+};
+
+class SampleLoader;
+class StreamingSampler;
+
+/** The background thread that reads the samples for the SampleLoaders.
+*
+*	Adding a job to a ThreadPool locks a CriticalSection and might allocate, so the SampleLoaders put their read requests
+*	into a preallocated lock free queue instead. This is safe to do from any thread (including the audio thread and several 
+*	threads at once). The thread is started when it is created.
+*/
+class StreamingThread: public Thread
+{
+public:
+
+	/** Creates and starts the thread.
+	*
+	*	@param maxNumRequests the size of the queue. Every SampleLoader can only wait once in the queue, so this must be
+	*						  bigger than the amount of voices that use this thread.
+	*/
+	StreamingThread(int maxNumRequests=MAX_NUM_STREAMING_REQUESTS);
+
+	/** Stops the thread. Delete all SampleLoaders that use this thread before you delete it. */
+	~StreamingThread();
+
+	/** Adds a read request for the SampleLoader and wakes up the thread.
+	*
+	*	The queue itself is lock free and never allocates. The thread is woken up with a WakeUpSemaphore, which is only 
+	*	signalled if the thread is about to sleep.
+	*
+	*	@return false if the queue is full.
+	*/
+	bool addRequest(SampleLoader *loader) noexcept;
+
+	/** Returns the amount of requests that are waiting in the queue. */
+	int getNumPendingRequests() const noexcept { return (int)(writePosition.get() - readPosition.get()); };
+
+	/** Reads the requests until the thread should exit. */
+	void run() override;
+
+private:
+
+	/** Returns the next request or nullptr if the queue is empty. This must only be called by the thread. */
+	SampleLoader *getNextRequest() noexcept;
+
+	JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(StreamingThread)
+
+	/** A slot of the queue. The sequence tells the producers and the consumer if the slot is free or holds a request. */
+	struct Request
+	{
+		Atomic<uint32> sequence;
+		SampleLoader *loader;
+	};
+
+	HeapBlock<Request> requests;
+	uint32 mask;
+
+	Atomic<uint32> writePosition;
+	Atomic<uint32> readPosition;
+
+	// Set by the thread before it checks the queue a last time and waits (the producers only wake it up then)
+	Atomic<int> isWaiting;
+	WakeUpSemaphore wakeUp;
+};
+
+/** The process wide streaming engine that is shared by all StreamingSamplers.
+*
+*	If there are multiple sampler instances in one process (eg. several plugin instances in a host), every instance would 
+*	have its own streaming thread and load its own copy of the same samples. Instead, all StreamingSamplers register with 
+*	this engine, which owns one StreamingThread and a pool of the loaded sounds. A file that is loaded a second time is 
+*	taken from the pool (every sampler maps it with its own MappedStreamingSound), so its preload buffers only exist once.
+*	The engine decides the preload size of the pooled sounds: every sampler requests the sizes that fit its budget and 
+*	a sound gets the biggest size that was requested, so the samplers don't resize the sounds against each other.
+*
+*	The engine also owns the thread that adapts the preload buffers of the registered samplers every 
+*	PRELOAD_ADAPTION_INTERVAL_MS milliseconds, so the preload buffers are never read from disk on the message thread.
+*
+*	The engine is created by the first call to acquire() and deleted when the last user calls release().
+*/
+class SharedStreamingEngine
+{
+public:
+
+	/** Returns the engine and registers a new user. Every call must be balanced by a call to release(). */
+	static SharedStreamingEngine *acquire();
+
+	/** Unregisters a user and deletes the engine if it was the last one. */
+	static void release();
+
+	/** Returns the thread that reads the samples for all voices. */
+	StreamingThread *getThread() noexcept { return &thread; };
+
+	/** Returns the sound for the file and loads it if it is not in the pool yet.
+	*
+	*	The file identity is the full path and the modification time, so a file that was changed on disk is loaded again.
+	*	The sound has no mapping of its own, so map it with a MappedStreamingSound. The reference is taken while the pool 
+	*	is locked, so releaseUnusedSounds() can't delete the sound before the caller adds it. This throws a LoadingError 
+	*	if the file can't be loaded.
+	*/
+	StreamingSamplerSound::Ptr getSound(const File &file);
+
+	/** Removes all sounds from the pool that are not used by a sampler anymore. */
+	void releaseUnusedSounds();
+
+	/** Returns the amount of sounds in the pool. */
+	int getNumSounds() const;
+
+	/** Tells the engine the stream buffer size of a sampler. 
+	*
+	*	The preload buffer of a shared sound must be as big as the biggest stream buffer of all samplers that play it, so
+	*	the samplers use this as lower limit for the preload sizes.
+	*/
+	void reportStreamBufferSize(int streamBufferSize) noexcept;
+
+	/** Returns the biggest stream buffer size that was reported by a sampler. */
+	int getMinimumPreloadSize() const noexcept { return largestStreamBufferSize.get(); };
+
+	/** Adds a sampler whose preload buffers are adapted by the adaption thread. */
+	void registerSampler(StreamingSampler *sampler);
+
+	/** Removes the sampler. If the adaption thread is adapting its preload buffers, this waits until it is finished. */
+	void unregisterSampler(StreamingSampler *sampler);
+
+	/** Wakes up the adaption thread, so the preload buffers are adapted right away (eg. after a sound was loaded). */
+	void triggerPreloadAdaption() { adaptionThread.notify(); };
+
+	/** The preload size that a sampler wants for a sound. */
+	struct PreloadRequest
+	{
+		StreamingSamplerSound::Ptr sound;
+		int preloadSize;
+		bool exceedsBudget; ///< true if the size was reduced to fit the budget of a sampler (then the sound shrinks right away)
+	};
+
+	/** Adds the request for the sound or raises the size of an existing request (the biggest size wins). */
+	static void addPreloadRequest(Array<PreloadRequest> &requests, StreamingSamplerSound *sound, int preloadSize, bool exceedsBudget);
+
+private:
+
+	/** Adapts the preload buffers of all registered samplers every PRELOAD_ADAPTION_INTERVAL_MS milliseconds. */
+	class AdaptionThread: public Thread
+	{
+	public:
+
+		AdaptionThread(SharedStreamingEngine &parent_);
+
+		void run() override;
+
+	private:
+
+		SharedStreamingEngine &parent;
+	};
+
+	/** Adapts the preload buffers of all registered samplers. */
+	void adaptPreloadSizes();
+
+	SharedStreamingEngine();
+	~SharedStreamingEngine();
+
+	/** Returns the key of the pool for the file. */
+	static String getSoundKey(const File &file);
+
+	StreamingThread thread;
+
+	CriticalSection poolLock;
+	ReferenceCountedArray<StreamingSamplerSound> pooledSounds;
+	StringArray pooledSoundKeys;
+
+	Atomic<int> largestStreamBufferSize;
+
+	CriticalSection samplerLock;
+	Array<StreamingSampler*> samplers;
+
+	AdaptionThread adaptionThread;
+
+	static CriticalSection instanceLock;
+	static SharedStreamingEngine *instance;
+	static int numUsers;
+
+	JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(SharedStreamingEngine)
 };
 
 /** This is a utility class that handles buffered sample streaming in a background thread.
 *
-*	It is derived from ThreadPoolJob, so whenever you want it to read new samples, add an instance of this 
-*	to a ThreadPool (but don't delete it!) and it will do what it is supposed to do.
+*	Whenever it needs new samples, it adds a request to the StreamingThread, which then calls runJob() (so don't 
+*	delete it while it is used by the thread). 
+*
+*	The sample is divided into blocks of getBufferSize() samples. The first blocks are read directly from the preload
+*	buffer of the sound, the following blocks are streamed into a ring of NUM_STREAM_BUFFERS stream buffers. 
+*	The background thread reads as many blocks ahead as the playback rate of the voice requires.
 */
-class SampleLoader: public ThreadPoolJob
+class SampleLoader
 {
 public:
 
 	/** Creates a new SampleLoader.
 	*
 	*	Normally you don't need to call this manually, as a StreamingSamplerVoice automatically creates a instance as member.
+	*
+	*	@param thread_ the thread that runs the read operations.
+	*	@param bufferPool_ if this is not nullptr, the stream buffers are taken from this pool when a note starts instead of being allocated by the loader.
 	*/
-	SampleLoader(ThreadPool *pool_):
-		ThreadPoolJob("SampleLoader"),
-		backgroundPool(pool_),
+	SampleLoader(StreamingThread *thread_, StreamingBufferPool *bufferPool_=nullptr):
 		sound(nullptr),
-		readIndex(0),
-		positionInSampleFile(0),
-		writeBufferIsBeingFilled(false),
-		diskUsage(0.0)
+		anchorBuffer(nullptr),
+		anchorPosition(0),
+		startIndex(0),
+		maximumBlockSize(0),
+		readBlock(0),
+		numPreloadBlocks(1),
+		blocksFilled(0),
+		blocksRequested(0),
+		noteIndex(0),
+		jobIsPending(0),
+		offlineMode(false),
+		playsFromMemory(false),
+		diskUsage(0.0),
+		lastCallToRequestData(0.0),
+		requestTime(0.0),
+		playbackRate(1.0),
+		maxPlaybackRate(1.0),
+		samplesPerCallback(0),
+		backgroundThread(thread_),
+		pendingStreamBuffers(nullptr),
+		retiredStreamBuffers(nullptr),
+		pendingBufferCapacity(0),
+		bufferPool(bufferPool_),
+		bufferSlot(-1),
+		slotToRelease(-1),
+		releaseIsPending(0)
 	{
+		streamData[0] = nullptr;
+		streamData[1] = nullptr;
+
+		for(int i = 0; i < NUM_STREAM_BUFFERS; i++) mappedBlocks[i] = nullptr;
+		bufferStride = 0;
+		bufferCapacity = 0;
+
 		setBufferSize(BUFFER_SIZE_FOR_STREAM_BUFFERS);
+		adoptPendingBuffers();
+
+		bufferSize = bufferCapacity;
 	};
 
-	/** Sets the buffer size in samples. */
-	void setBufferSize(int newBufferSize);
+	~SampleLoader();
+
+	/** Sets the buffer size in samples. 
+	*
+	*	If USE_ADAPTIVE_STREAM_BUFFERS is enabled, this is the maximum size and the actual size will be chosen 
+	*	on every startNote() depending on the disk latency and the playback rate. If the loader uses a StreamingBufferPool,
+	*	the size is limited to the buffer size of the pool.
+	*
+	*	You can call this while the voice is playing (but not from the audio thread): if the new size needs bigger buffers, they 
+	*	are allocated here and swapped in at the next startNote(). The old buffers are deleted by the next call to setBufferSize()
+	*	or releaseUnusedBuffers() as soon as the background thread does not use them anymore.
+	*/
+	void setBufferSize(int newBufferSize);
+
+	/** Deletes the old stream buffers if they are not used anymore. Don't call this from the audio thread. */
+	void releaseUnusedBuffers();
+
+	/** Returns the buffer size that is currently used for streaming. */
+	int getBufferSize() const noexcept { return bufferSize; };
+
+	/** Sets the biggest block size of the audio callback. 
+	*
+	*	The adaptive stream buffers never get so small that the stream buffers can't hold one block at MAX_SAMPLER_PITCH.
+	*	This is used at the next startNote().
+	*/
+	void setMaximumBlockSize(int samplesPerBlock) noexcept { maximumBlockSize = jmax(0, samplesPerBlock); };
+
+	/** This fills the stream buffers with samples from the SamplerSound until the requested read-ahead horizon is reached.
+	*
+	*	This is called by the StreamingThread. Also it measures the time for getDiskUsage();
+	*
+	*	@return true if the horizon moved while the blocks were read, so it needs to run again.
+	*/
+	bool runJob();
+
+	/** Prepares the loader for reading a range of samples.
+	*
+	*	It tells the background thread to read the next blocks if the read position moved to a new block and
+	*	checks if every block of the range is loaded.
+	*
+	*	@param sampleIndex the index in the sample file. This acts as the exact "clock" variable (unlike numSamples), so make sure
+						   you supply the right value here, or it will stutter pretty ugly!
+	*	@param numSamples the expected amount of samples that is likely to be used in the current processBlock method.
+	*					  This number doesn't need to be exact (you can ask for more samples than you actually need),
+	*	@return false if the background thread was not fast enough (this never happens in offline mode).
+	*/
+	bool prepareSampleRange(int sampleIndex, int numSamples);
+
+	/** Enables the offline mode.
+	*
+	*	In offline mode, prepareSampleRange() waits for the missing blocks instead of failing (and reads them in the calling 
+	*	thread if the background thread is not already reading them), so the rendering is deterministic. The loader also 
+	*	uses the biggest buffer size and always reads as many blocks ahead as possible. The buffer size changes with the next note.
+	*/
+	void setOfflineMode(bool shouldBeOffline) noexcept { offlineMode = shouldBeOffline; };
+
+	/** Checks if the loader is in offline mode. */
+	bool isOffline() const noexcept { return offlineMode; };
 
-	/** This fills the currently inactive buffer with samples from the SamplerSound.
+	/** Requests all blocks of the read-ahead horizon of the current note. 
 	*
-	*	The write buffer will be locked for the time of the read operation. Also it measures the time for getDiskUsage();
+	*	The StreamingSampler calls this for all voices before it renders them in offline mode, so the background thread
+	*	can read the blocks of all voices in one go while the voices are rendered.
 	*/
-	JobStatus runJob() override;
+	void requestReadAhead();
 
-	/** Fills a AudioSampleBuffer with samples from the current read buffer.
+	/** Gives direct read access to the stream buffers.
 	*
-	*	It uses two internal buffers. If the active buffer 'A' is completely read, it swaps the buffers, continues reading from buffer 'B' and returns true, so you can 
-	*	run the background thread that fills the buffer 'A' with new samples.
+	*	The pointers are only valid until the end of the block that contains the sample, so you must call this again
+	*	for the next block. Call prepareSampleRange() before you call this method.
 	*
-	*	@param sampleBlockBuffer the buffer that will be filled.
-	*	@param numSamples the expected amount of samples that is likely to be used in the current processBlock method.
-	*					  This number doesn't need to be exact (you can ask for more samples than you actually need),
-	*	@param sampleIndex the index in the sample file. This acts as the exact "clock" variable (unlike numSamples), so make sure
-						   you supply the right value here, or it will stutter pretty ugly!
+	*	@param sampleIndex the index in the sample file.
+	*	@param l will point to the left channel of the sample.
+	*	@param r will point to the right channel of the sample.
+	*	@param stride will be the distance between two samples of a channel. This is 1 for planar buffers and 2 if the block is
+	*				  interleaved (see INTERLEAVED_STREAM_BUFFERS and USE_ZERO_COPY_STREAMING).
+	*	@return the number of samples that can be read from the pointers.
 	*/
-	void fillSampleBlockBuffer(AudioSampleBuffer &sampleBlockBuffer, int numSamples, int sampleIndex);
+	int getReadPointers(int sampleIndex, const float *&l, const float *&r, int &stride) const;
 	
 	/** Call this whenever a sound was started.
 	*
 	*	This will set the read pointer to the preload buffer of the StreamingSamplerSound and start the background reading.
+	*
+	*	If there is a start offset, the loader begins at the last start anchor before the offset. All sample indexes of the
+	*	note (prepareSampleRange(), getReadPointers()) are then relative to this anchor, so the voice must start at getStartIndex().
+	*
+	*	@param s the sound that will be streamed
+	*	@param playbackRate_ the pitch factor of the voice. It is used to calculate the buffer size if USE_ADAPTIVE_STREAM_BUFFERS is enabled.
+	*	@param startOffset the position in the stream where the note starts.
+	*	@return false if the loader uses a StreamingBufferPool and there are no free stream buffers.
+	*/
+	bool startNote(StreamingSamplerSound const *s, double playbackRate_=1.0, int64 startOffset=0);
+
+	/** Returns the stream position of the start anchor that is used for the current note. */
+	int64 getAnchorPosition() const noexcept { return anchorPosition; };
+
+	/** Returns the sample index (relative to the anchor) where the current note starts. 
+	*
+	*	The start offset must be inside the preload buffer of the anchor, so it might be smaller than the requested offset.
+	*/
+	int getStartIndex() const noexcept { return startIndex; };
+
+	/** Tells the loader how fast the voice is currently consuming samples.
+	*
+	*	The read-ahead horizon is calculated from these values, so a highly pitched voice reads more blocks in advance.
+	*
+	*	@param currentRate the average playback rate of the current block.
+	*	@param maximumRate the highest playback rate of the current block (if the pitch is modulated, this can be bigger than the average).
+	*/
+	void setPlaybackRate(double currentRate, double maximumRate) noexcept
+	{
+		playbackRate = currentRate;
+		maxPlaybackRate = jmax(currentRate, maximumRate);
+	};
+
+	/** Returns the amount of blocks that the background thread should keep ready in front of the read position. */
+	int getNumBlocksToReadAhead() const noexcept;
+
+	/** Returns how much of the read-ahead horizon is already loaded (1.0 means that every requested block is ready). */
+	double getBufferFillRatio() const noexcept;
+
+	/** Returns the ratio between the samples that the voice consumes during the slowest recent read operation and the 
+	*	maximum read-ahead of the loader. If this approaches 1.0, the disk can't keep up with this voice.
+	*/
+	double getLatencyLoad() const noexcept;
+
+	/** Returns the average playback rate of the last block. */
+	double getPlaybackRate() const noexcept { return playbackRate; };
+
+	/** Checks if the background thread is currently reading (or the request is waiting in the queue) for this loader. */
+	bool isReadingFromDisk() const noexcept { return jobIsPending.get() != 0; };
+
+	/** Checks if the loader has read all blocks of the preload buffer and streams the sample from disk. */
+	bool isStreamingFromDisk() const noexcept 
+	{ 
+		return sound != nullptr && ! playsFromMemory && readBlock + 1 + getNumBlocksToReadAhead() > numPreloadBlocks; 
+	};
+
+	/** Checks if the current note plays directly from memory.
+	*
+	*	If the preload buffer contains the entire sample (and the sound is not looped), the whole buffer is used as one block:
+	*	the note doesn't take stream buffers from the pool and never sends a request to the background thread.
 	*/
-	void startNote(StreamingSamplerSound const *s);
+	bool isPlayingFromMemory() const noexcept { return playsFromMemory; };
 
 	/** Returns the loaded sound. */
 	const StreamingSamplerSound *getLoadedSound() const { return sound;	};
 
-	/** Resets the loader (unloads the sound). */
-	void reset()
-	{
-		ScopedLock sl(lock);
-		sound = nullptr;
-		diskUsage = 0.0;
-	}
+	/** Resets the loader (unloads the sound). 
+	*
+	*	If the loader uses a StreamingBufferPool, the stream buffers are given back to the pool (or as soon as the 
+	*	background thread has finished the current read operation).
+	*/
+	void reset();
 
 	/** Calculates and returns the disk usage.
 	*
@@ -272,62 +1376,132 @@ private:
 	// ============================================================================================ internal methods
 
 	void requestNewData();
-	
-	bool swapBuffers();
 
-	void fillInactiveBuffer();
+	/** Reads the next block into its stream buffer. Returns false if there is nothing to do. */
+	bool fillNextBlock();
+
+	/** Gives the stream buffers back to the pool if the reset() was called while the background thread was reading. */
+	void releasePendingSlot();
+
+	/** Swaps in the buffers that were allocated by setBufferSize(). This is called in the audio thread when a note starts. */
+	void adoptPendingBuffers();
+
+	/** Returns a pointer to the start of the block (either in the preload buffer or in one of the stream buffers). */
+	const float *getBlockReadPointer(int blockIndex, int channel) const;
+
+	/** Fills an interleaved stream buffer. The sound only fills planar buffers, so the block is read in small chunks and interleaved. */
+	static void fillInterleavedBlock(StreamingSamplerSound const *s, float *destination, int numSamples, int64 streamPosition, 
+									 const StreamingSamplerSound::PreloadData &data);
+
+	/** Checks if the read position moved and requests the next blocks. */
+	void updateReadPosition(int sampleIndex);
+
+	int getAdaptedBufferSize(StreamingSamplerSound const *s, double rate) const;
+
+	/** Waits until the block is loaded (and reads it in the calling thread if the background thread is not reading). */
+	void waitForBlock(int blockIndex);
 
 	// ============================================================================================ member variables
 
-	/** The class tries to be as lock free as possible (it only locks the buffer that is filled 
-	*	during the read operation, but I have to lock everything for a few calls, so that's why
-	*	there is a critical section.	
+	/** The class tries to be as lock free as possible (the read-ahead state is handled with atomic counters),
+	*	but I have to lock everything for a few calls. The background thread never reads from disk while it holds 
+	*	the lock, so a SpinLock is enough (and the audio thread can't be blocked by a read operation).
 	*/
-	CriticalSection lock;
-
-	/** A simple mutex for the buffer that is being used for loading. */
-	bool writeBufferIsBeingFilled;
+	SpinLock lock;
 
 	// variables for handling of the internal buffers
 
 	StreamingSamplerSound const *sound;
-	int readIndex;
+	StreamingSamplerSound::PreloadData::Ptr preload;
+	const AudioSampleBuffer *anchorBuffer;
+	int64 anchorPosition;
+	int startIndex;
 	int bufferSize;
-	int64 positionInSampleFile;
-	AudioSampleBuffer const *readBuffer;
-	AudioSampleBuffer *writeBuffer;
+	int bufferCapacity;
+	int maximumBlockSize;
+	int readBlock;
+	int numPreloadBlocks;
+
+	/** The amount of blocks that can be read (written by the background thread). */
+	Atomic<int> blocksFilled;
+
+	/** The amount of blocks the background thread should read (written by the audio thread). */
+	Atomic<int> blocksRequested;
+
+	/** This is incremented on every note, so the background thread can throw away blocks of a previous note. */
+	int noteIndex;
 
-	double lastPosition;
+	/** A simple mutex that prevents adding the request to the queue twice. */
+	Atomic<int> jobIsPending;
+
+	bool offlineMode;
+	bool playsFromMemory;
 
 	// variables for disk usage measurement
 
 	double diskUsage;
 	double lastCallToRequestData;
+	double requestTime;
+	double playbackRate;
+	double maxPlaybackRate;
+
+	// The amount of samples of the last prepareSampleRange() call (this is already scaled with the playback rate)
+	int samplesPerCallback;
+
+	// just a pointer to the used thread
+	StreamingThread *backgroundThread;
+
+	// the internal buffers (NUM_STREAM_BUFFERS blocks with bufferStride samples each). They either point to 
+	// the ownedStreamBuffers or to a slot of the bufferPool. If INTERLEAVED_STREAM_BUFFERS is enabled, 
+	// both channels are stored in streamData[0] (so every block has 2 * bufferStride values).
+
+	float *streamData[2];
+	int bufferStride;
+
+	// If a stream block was not copied, this points to its interleaved samples in the mapped file (written by the background thread)
+	const float *mappedBlocks[NUM_STREAM_BUFFERS];
+
+	ScopedPointer<ResidentSampleBuffer> ownedStreamBuffers;
+
+	// variables for the reconfiguration (setBufferSize() creates the pending buffers, the next note swaps them in and retires the old ones)
 
-	// just a pointer to the used pool
-	ThreadPool *backgroundPool;
+	Atomic<ResidentSampleBuffer*> pendingStreamBuffers;
+	Atomic<ResidentSampleBuffer*> retiredStreamBuffers;
+	Atomic<int> pendingBufferCapacity;
 
-	// the internal buffers
+	// variables for the pooled stream buffers
 
-	AudioSampleBuffer b1, b2;
+	StreamingBufferPool *bufferPool;
+	int bufferSlot;
+	int slotToRelease;
+	Atomic<int> releaseIsPending;
 };
 
 /** A SamplerVoice that streams the data from a StreamingSamplerSound
 *
-*	It uses a SampleLoader object to fetch the data and copies the values into an internal buffer, so you
+*	It uses a SampleLoader object to fetch the data and interpolates the samples directly from its stream buffers, so you
 *	don't have to bother with the SampleLoader's internals.
 */
 class StreamingSamplerVoice: public SynthesiserVoice
 {
 public:
-	StreamingSamplerVoice(ThreadPool *backgroundThreadPool);
+	/** Creates a new voice.
+	*
+	*	@param backgroundThread the thread that reads the samples.
+	*	@param bufferPool an optional pool for the stream buffers. If you supply one, the voice only uses memory while it is playing.
+	*/
+	StreamingSamplerVoice(StreamingThread *backgroundThread, StreamingBufferPool *bufferPool=nullptr);
 	
 	~StreamingSamplerVoice() {};
 
 	/** Always returns true. */
 	bool canPlaySound (SynthesiserSound*) { return true; };
 
-	/** starts the streaming of the sound. */
+	/** starts the streaming of the sound. 
+	*
+	*	This is real time safe: it doesn't lock, allocate or touch the mapped file (the start of the sample is read from the preload buffer).
+	*	The sound must be a StreamingSoundMapping (a StreamingSamplerSound or a MappedStreamingSound).
+	*/
 	void startNote (int midiNoteNumber, float velocity, SynthesiserSound* s, int /*currentPitchWheelPosition*/) override;
 	
 	const StreamingSamplerSound *getLoadedSound()
@@ -335,24 +1509,161 @@ public:
 		return loader.getLoadedSound();
 	}
 
+	/** Sets the buffer size of the SampleLoader. It is safe to call this while the voice is playing (the new size is used for the next note). */
 	void setLoaderBufferSize(int newBufferSize)
 	{
 		loader.setBufferSize(newBufferSize);
 	};
 
-	/** Clears the note data and resets the loader. */
-	void stopNote (bool /*allowTailOff*/)
-	{ 
-		clearCurrentNote();
-		loader.reset();
+	/** Sets the biggest block size of the audio callback (see SampleLoader::setMaximumBlockSize()). */
+	void setMaximumBlockSize(int samplesPerBlock) noexcept { loader.setMaximumBlockSize(samplesPerBlock); };
+
+	/** Enables the offline mode of the SampleLoader (see SampleLoader::setOfflineMode()). */
+	void setOfflineMode(bool shouldBeOffline) noexcept { loader.setOfflineMode(shouldBeOffline); };
+
+	/** Requests all blocks of the read-ahead horizon if the voice is playing. */
+	void requestReadAhead()
+	{
+		if(loader.getLoadedSound() != nullptr) loader.requestReadAhead();
+	};
+
+	/** Stops the note.
+	*
+	*	If allowTailOff is true, the voice fades out over the release time of the sound (and keeps streaming in the meantime).
+	*	Afterwards it clears the note data and resets the loader, so the stream buffers are given back to the pool.
+	*	If allowTailOff is false, this happens immediately.
+	*/
+	void stopNote (bool allowTailOff) override;
+
+	/** Fades out the voice and stops it afterwards. 
+	*
+	*	This is used for the release and by the StreamingSampler to crossfade stolen voices. The voice keeps its note until
+	*	the fade is finished, so it won't be used for a new note in the meantime. If the voice is already fading out, 
+	*	the fade can only get shorter.
+	*/
+	void fadeOut(int numSamplesToFade);
+
+	/** Checks if the voice is currently fading out (because it was released or stolen). */
+	bool isFadingOut() const noexcept { return fadeSamplesRemaining > 0; };
+
+	/** Sets the start offset in samples for the next note (eg. from a modulation source).
+	*
+	*	The offset is added to the velocity start offset of the sound. The sound should have start anchors for this range,
+	*	otherwise the voice starts at the end of the preload buffer.
+	*/
+	void setSampleStartOffset(int64 offsetInSamples) noexcept { sampleStartOffset = jmax<int64>(0, offsetInSamples); };
+
+	/** Returns the velocity of the current note. */
+	float getVelocity() const noexcept { return velocity; };
+
+	/** Sets the gain of the voice (it is multiplied with the velocity of the note). 
+	*
+	*	The change is smoothed over VOICE_GAIN_SMOOTHING_SAMPLES samples. Call this from the audio thread (eg. before renderNextBlock()).
+	*/
+	void setGain(float newGain) noexcept;
+
+	/** Returns the gain of the voice (without the velocity). */
+	float getGain() const noexcept { return gain; };
+
+	/** Sets the pan of the voice from -1.0 (left) to 1.0 (right). 
+	*
+	*	This is a balance control: the center position plays both channels unchanged and the other positions attenuate one 
+	*	channel. The change is smoothed like setGain().
+	*/
+	void setPan(float newPan) noexcept;
+
+	/** Returns the pan of the voice. */
+	float getPan() const noexcept { return pan; };
+
+	/** How the voice writes its output to the buffer of renderNextBlock(). */
+	enum MixMode
+	{
+		AddToBuffer = 0, ///< the voice adds its output to the buffer
+		OverwriteBuffer ///< the voice overwrites the buffer (the samples after the end of the note are cleared)
+	};
+
+	/** Sets the mix mode. The default is set with OVERWRITE_BUFFER_WITH_VOICE_DATA. */
+	void setMixMode(MixMode newMixMode) noexcept { mixMode = newMixMode; };
+
+	/** Returns the mix mode. */
+	MixMode getMixMode() const noexcept { return mixMode; };
+
+	/** Returns a counter value that is incremented for every note, so you can check which voice was started first. */
+	uint32 getNoteIndex() const noexcept { return noteIndex; };
+
+	/** Sets the counter for the note indexes, which must be shared by all voices of the synthesiser (the StreamingSampler 
+	*	does this for its voices). It is only incremented in startNote(), so it doesn't need to be atomic.
+	*/
+	void setNoteCounter(uint32 *sharedNoteCounter) noexcept { noteCounter = sharedNoteCounter; };
+
+	/** Returns the amount of disk bandwidth the voice needs (this is the playback rate while it streams from disk and zero if it only reads the preload buffer). */
+	double getStreamingCost() const noexcept
+	{
+		return loader.isStreamingFromDisk() ? loader.getPlaybackRate() : 0.0;
 	};
 
+	/** Gives read only access to the SampleLoader (eg. for measuring the streaming load). */
+	const SampleLoader &getLoader() const noexcept { return loader; };
+
 	/** Adds it's output to the outputBuffer. */
 	void renderNextBlock(AudioSampleBuffer &outputBuffer, int startSample, int numSamples) override;
 
+	/** The gains of both channels for a chunk. They are linear ramps that combine the velocity, the gain, the pan and the fade out. */
+	struct ChunkGains
+	{
+		float left;
+		float right;
+		float leftDelta;
+		float rightDelta;
+	};
+
+	/** The state of a voice for a chunk of the batch renderer (see StreamingSampler::setBatchRendering()). */
+	struct BatchLane
+	{
+		const float *left;
+		const float *right;
+		int stride;
+
+		float position; ///< the position relative to left / right
+		float increment;
+		ChunkGains gains;
+	};
+
+	/** Prepares the block for the batch renderer.
+	*
+	*	Returns true if the voice adds its output with a constant pitch, its fade doesn't end in this block and all samples of 
+	*	the block are loaded. Otherwise the voice must be rendered with renderNextBlock() (this method only has side effects that 
+	*	renderNextBlock() repeats anyway).
+	*/
+	bool prepareBatchBlock(int startSample, int numSamples);
+
+	/** Fills the lane for the next chunk. Returns false if the chunk crosses a block of the loader (use renderChunkDirectly() then). */
+	bool getBatchLane(int numSamples, BatchLane &lane) const;
+
+	/** Advances the voice after the batch renderer rendered a chunk of its lane. */
+	void advanceBatchLane(int numSamples) noexcept
+	{
+		voiceUptime += (double)numSamples * uptimeDelta;
+		advanceGains(numSamples);
+	};
+
+	/** Renders a chunk of a prepared batch block with the normal kernel. */
+	void renderChunkDirectly(float *outL, float *outR, int startSample, int numSamples);
+
+	/** Updates the fade out after the whole batch block was rendered. */
+	void finishBatchBlock(int numSamples) noexcept
+	{
+		if(isFadingOut())
+		{
+			fadeGain = jmax(0.0f, fadeGain);
+			fadeSamplesRemaining -= numSamples;
+		}
+	};
+
 	/** You can pass a pointer with float values containing pitch information for each sample.
 	*
-	*	The array size should be exactly the number of samples that are calculated in the current renderNextBlock method.
+	*	The array is indexed like the output buffer of renderNextBlock (so it must contain a value for every sample of the 
+	*	output buffer). This keeps the modulation sample accurate if the Synthesiser splits the block at MIDI events.
 	*/
 	void setPitchValues(const float *pitchDataForBlock)	{ pitchData = pitchDataForBlock; };
 
@@ -362,32 +1673,73 @@ public:
 	*/
 	double getDiskUsage() {	return loader.getDiskUsage(); };
 
-	/** Initializes its sampleBuffer. You have to call this manually, since there is no base class function. */
-	void prepareToPlay(double sampleRate, int samplesPerBlock)
-	{
-		if(sampleRate != -1.0)
-		{
-			samplesForThisBlock = AudioSampleBuffer(2, samplesPerBlock * MAX_SAMPLER_PITCH);
-			samplesForThisBlock.clear();
-		}
-	}
-
 	/** Not implemented */
 	virtual void controllerMoved(int /*controllerNumber*/, int /*controllerValue*/) override { };
 
 	/** Not implemented */
 	virtual void pitchWheelMoved(int /*pitchWheelValue*/) override { };
 
-	/** resets everything. */
+	/** resets everything (and gives the stream buffers back to the pool). */
 	void resetVoice()
 	{
 		voiceUptime = 0.0;
 		uptimeDelta = 0.0;
+		fadeGain = 1.0f;
+		fadeDelta = 0.0f;
+		fadeSamplesRemaining = 0;
 		clearCurrentNote();
+		loader.reset();
 	};
 
 private:
 
+	/** Returns the amount that the voice advances for the given sample of the output buffer.
+	*
+	*	This is used for calculating the sample range and for the playback itself, so both clamp the pitch the same way.
+	*/
+	double getUptimeDelta(int sampleIndex) const noexcept
+	{
+		return pitchData == nullptr ? uptimeDelta : jlimit(0.0, (double)MAX_SAMPLER_PITCH, uptimeDelta * (double)pitchData[sampleIndex]);
+	};
+
+	/** Returns the amount of samples the voice consumes in the block (including the fraction of the current position). */
+	double getNumSamplesUsed(int startSample, int numSamples, double &maxRate) const noexcept;
+
+	/** The render kernels that are selected once per block by renderNextBlock(). */
+	enum PitchMode
+	{
+		UnityPitch = 0, ///< the voice plays at the root pitch without modulation, so the samples are simply copied
+		ConstantPitch, ///< the voice plays with a constant pitch factor
+		ModulatedPitch ///< the pitch is modulated with the values from setPitchValues()
+	};
+
+	/** Selects the render kernel for the block. */
+	template <MixMode mixMode> void renderSamples(float *outL, float *outR, int startSample, int numSamples);
+
+	/** Renders the (already prepared) samples into the output and advances the voice and its gains. */
+	template <PitchMode mode, MixMode mixMode> void renderSamples(float *outL, float *outR, int startSample, int numSamples);
+
+	/** Writes (or adds) the source samples to the destination with the gain ramps and advances the gains. */
+	template <MixMode mixMode> 
+	static void writeWithGain(float *destL, float *destR, const float *sourceL, const float *sourceR, int sourceStride, int numSamples, ChunkGains &gains);
+
+	/** Interpolates the samples at the given positions (in samples from the start of the file) and writes (or adds) them 
+	*	with the gain ramps to the destination.
+	*
+	*	The positions must be ascending and inside the range that was prepared with SampleLoader::prepareSampleRange().
+	*/
+	template <MixMode mixMode> 
+	void interpolateWithGain(const double *positions, float *destL, float *destR, int numSamples, ChunkGains gains) const;
+
+	/** Returns the gain ramps for the next numSamples samples (without advancing the gains). */
+	ChunkGains getChunkGains(int numSamples) const noexcept;
+
+	/** Advances the fade out and the gain smoothing. */
+	void advanceGains(int numSamples) noexcept;
+
+	/** Calculates the channel gains from the velocity, the gain and the pan. */
+	void updateTargetGains(bool smoothChange) noexcept;
+
 	const float *pitchData;
 
 	// This lets the wrapper class access the internal data without annoying get/setters
@@ -396,9 +1748,317 @@ private:
 	double voiceUptime;
 	double uptimeDelta;
 
-	AudioSampleBuffer samplesForThisBlock;
+	int64 sampleStartOffset;
+
+	float velocity;
+	uint32 noteIndex;
+	uint32 *noteCounter;
+
+	float gain;
+	float pan;
+
+	// The smoothed gains of both channels (without the fade out)
+	float currentGainL, currentGainR;
+	float targetGainL, targetGainR;
+	float gainStepL, gainStepR;
+	int smoothingSamplesRemaining;
+
+	MixMode mixMode;
+
+	float fadeGain;
+	float fadeDelta;
+	int fadeSamplesRemaining;
 
 	SampleLoader loader;
 };
 
+/** A Synthesiser that streams its sounds from disk.
+*
+*	This is the integrated engine: it owns the streaming thread, the stream buffer pool and the voices, and it manages the
+*	preload buffers of all sounds within a memory budget. All you have to do is:
+*
+*	- set the amount of voices with setNumVoices()
+*	- add the sounds with loadSound()
+*	- call prepareToPlay() and renderNextBlock() in your AudioProcessor.
+*
+*	It limits the polyphony if the disk can't keep up (this is measured with the telemetry of the SampleLoaders: 
+*	the fill state of the read-ahead buffers, the length of the request queue and the recent read latency).
+*
+*	If a voice must be stolen, it prefers voices that are already fading out, quiet (low velocity) and expensive to stream
+*	(highly pitched voices that read from disk). If there is a free voice, the stolen voice is faded out while the new note 
+*	starts on the free voice, so make sure you add a few more voices than the maximum polyphony.
+*
+*	All voices must be StreamingSamplerVoices and all sounds must be StreamingSamplerSounds.
+*/
+class StreamingSampler: public Synthesiser
+{
+public:
+
+	/** Creates a StreamingSampler.
+	*
+	*	The sampler registers with the SharedStreamingEngine, so all samplers in the process share the sounds of the pool.
+	*
+	*	@param externalThread the thread that is used by the voices. If this is nullptr, the thread of the shared engine is used.
+	*/
+	StreamingSampler(StreamingThread *externalThread=nullptr);
+
+	/** Deletes the voices before the thread and the buffer pool are deleted and releases the shared engine. */
+	~StreamingSampler();
+
+	/** Creates the voices. 
+	*
+	*	They share a StreamingBufferPool with one slot for every voice that can play at the same time (the maximum 
+	*	polyphony plus NUM_FADE_OUT_STREAM_SLOTS), so the stream buffers don't scale with the amount of voices. A note that 
+	*	doesn't get a slot is dropped (notes that play from memory don't need one). Add a few more voices than the maximum 
+	*	polyphony, so stolen voices can be faded out. Don't call this from the audio thread.
+	*/
+	void setNumVoices(int numVoices);
+
+	/** Loads a sound and adds it to the sampler.
+	*
+	*	If another sampler in the process already loaded the file, the sound is shared (with the mapping of this sampler). 
+	*	Changes to the returned sound (eg. the loop points) apply to all samplers that play the file. The preload size is 
+	*	adapted to the preload budget right afterwards on the adaption thread of the SharedStreamingEngine. 
+	*	This throws a LoadingError if the file can't be loaded.
+	*/
+	StreamingSamplerSound *loadSound(const File &file, const BigInteger &midiNotes, int rootNote);
+
+	/** Prepares the engine for playback. 
+	*
+	*	This sets the sample rate, resizes the stream buffers to STREAM_BUFFER_SIZE_IN_BLOCKS blocks (the voices are created 
+	*	again if the size changes), resizes the buffers of the render threads and adapts the preload buffers of all sounds 
+	*	to the measured disk latency and the preload budget. The preload buffers are adapted every PRELOAD_ADAPTION_INTERVAL_MS 
+	*	milliseconds on the adaption thread of the SharedStreamingEngine, so they follow the latency that is measured during 
+	*	playback without reading from disk on the message thread.
+	*/
+	void prepareToPlay(double newSampleRate, int samplesPerBlock);
+
+	/** Sets the maximum length (in samples) of the sounds that are loaded entirely into memory.
+	*
+	*	These sounds are played without streaming (see SampleLoader::isPlayingFromMemory()). They are not limited by the 
+	*	preload budget. This is applied at the next adaption of the preload buffers (sounds that are already in memory stay there).
+	*/
+	void setInMemoryLength(int64 maxLengthInSamples) noexcept { inMemoryLength = maxLengthInSamples; };
+
+	/** Sets the amount of memory in bytes that can be used by the preload buffers of all sounds. 
+	*
+	*	If the preload sizes that are needed for the measured disk latency don't fit into the budget, they are reduced 
+	*	evenly (but never below the stream buffer size). This is applied at the next adaption of the preload buffers.
+	*
+	*	If LOCK_AUDIO_MEMORY is enabled, the locked stream buffers are charged against this budget and it also limits the 
+	*	memory that can be locked (see ResidentMemoryLock::setMemoryBudget(), which is process wide, so all samplers 
+	*	should use the same budget).
+	*/
+	void setPreloadBudget(int64 newBudgetInBytes) noexcept
+	{
+		preloadBudget = newBudgetInBytes;
+		ResidentMemoryLock::setMemoryBudget(newBudgetInBytes);
+	};
+
+	/** Returns the amount of memory that is used by the preload buffers of all sounds. */
+	size_t getPreloadMemoryUsage() const;
+
+	/** Returns the size of the stream buffers in samples. */
+	int getStreamBufferSize() const noexcept { return streamBufferSize; };
+
+	/** Returns the sum of the disk usage of all voices (see StreamingSamplerVoice::getDiskUsage()). */
+	double getDiskUsage();
+
+	/** Sets the maximum amount of voices that can play at the same time (if the disk is fast enough). 
+	*
+	*	This sets the size of the buffer pool, so the voices are created again if the size changes. Don't call this from the audio thread.
+	*/
+	void setMaxPolyphony(int newMaxPolyphony);
+
+	/** Returns the current polyphony limit. This is smaller than the maximum polyphony if the disk can't keep up. */
+	int getPolyphonyLimit() const noexcept { return polyphonyLimit; };
+
+	/** Sets the time in milliseconds for the fade out of stolen voices. */
+	void setStealFadeTime(double newFadeTimeMilliseconds) noexcept { stealFadeTimeMs = newFadeTimeMilliseconds; };
+
+	/** Sets the streaming load where the polyphony is reduced (the default is 0.75, 1.0 means that the disk just keeps up). */
+	void setMaxStreamingLoad(double newMaxLoad) noexcept { maxStreamingLoad = newMaxLoad; };
+
+	/** Returns the current streaming load of all voices.
+	*
+	*	This is the maximum of the missing read-ahead blocks of the worst voice, the ratio of voices that are waiting in the 
+	*	request queue and the worst latency load (see SampleLoader::getLatencyLoad()).
+	*/
+	double getStreamingLoad() const;
+
+	/** Renders the voices on multiple threads.
+	*
+	*	The render threads and the audio thread take the voices one by one from a shared counter (so a thread that renders
+	*	cheap voices simply takes more of them). Every render thread adds its voices to its own buffer, which is added to the 
+	*	output after all voices are rendered. A job that a render thread did not start yet is taken back, so the audio thread
+	*	only waits for the voices that are rendered at the moment (the MIDI events of the next block can change every voice, 
+	*	so no voice may still be rendered when the block ends). Call this before the playback starts (not from the audio thread). 
+	*	If a voice overwrites the buffer (see StreamingSamplerVoice::setMixMode()), the block is rendered in the audio thread only.
+	*
+	*	@param numThreads the amount of additional threads. If this is 0, the voices are rendered in the audio thread only.
+	*	@param maximumBlockSize the biggest block size of the audio callback. Bigger blocks are rendered in the audio thread only.
+	*/
+	void setNumRenderThreads(int numThreads, int maximumBlockSize);
+
+	/** Returns the amount of additional render threads. */
+	int getNumRenderThreads() const noexcept { return renderThreads.size(); };
+
+	/** Enables the batch renderer.
+	*
+	*	Instead of rendering one voice after another, the voices with a constant pitch are rendered in batches of 
+	*	VOICE_BATCH_SIZE voices: their positions, increments and gains are stored in SIMD registers (one voice per lane) and 
+	*	the samples are fetched with gather instructions (AVX2, or a scalar loop on other CPUs). This is faster for many 
+	*	short voices with a similar pitch. Voices with a modulated pitch or a fade that ends in the block are rendered as usual.
+	*	This is only used if the block is not rendered on multiple threads. Voices that overwrite the buffer 
+	*	(see StreamingSamplerVoice::setMixMode()) are never rendered in batches.
+	*/
+	void setBatchRendering(bool shouldRenderInBatches) noexcept;
+
+	/** Checks if the batch renderer is enabled. */
+	bool isBatchRendering() const noexcept { return batchRendering; };
+
+	/** Enables the offline mode for all voices.
+	*
+	*	Use this when the host renders faster than realtime (eg. AudioProcessor::isNonRealtime()). The voices wait for
+	*	the disk instead of dropping out and every block starts with read requests for all playing voices, so the 
+	*	background thread reads the biggest possible segments of all voices in one batch.
+	*/
+	void setOfflineMode(bool shouldBeOffline);
+
+	/** Checks if the sampler is in offline mode. */
+	bool isOffline() const noexcept { return offlineMode; };
+
+protected:
+
+	/** Renders the voices (in parallel if there are render threads). */
+	void renderVoices(AudioSampleBuffer &outputBuffer, int startSample, int numSamples) override;
+
+	/** Finds a free voice while respecting the polyphony limit and steals the cheapest voice if necessary. */
+	SynthesiserVoice* findFreeVoice(SynthesiserSound* soundToPlay, const bool stealIfNoneAvailable) const override;
+
+private:
+
+	/** Returns the voice that should be stolen first. 
+	*
+	*	@param includeFadingVoices if true, voices that are fading out are the first candidates. If false, they are ignored
+	*							   (and this returns nullptr if every voice is fading out).
+	*/
+	StreamingSamplerVoice *getVoiceToSteal(bool includeFadingVoices) const;
+
+	/** Returns the voice with the given index. All voices must be StreamingSamplerVoices, so the type is only checked in debug builds. */
+	StreamingSamplerVoice *getStreamingVoice(int index) const noexcept
+	{
+		jassert(dynamic_cast<StreamingSamplerVoice*>(voices.getUnchecked(index)) != nullptr);
+
+		return static_cast<StreamingSamplerVoice*>(voices.getUnchecked(index));
+	};
+
+	/** Returns the sample data of the sound with the given index. All sounds must be StreamingSoundMappings, so the type is only checked in debug builds. */
+	StreamingSamplerSound *getStreamingSound(int index) const noexcept
+	{
+		SynthesiserSound *sound = sounds.getUnchecked(index);
+
+		jassert(dynamic_cast<StreamingSoundMapping*>(sound) != nullptr);
+
+		return static_cast<StreamingSoundMapping*>(sound)->getStreamingSound();
+	};
+
+	/** Lowers the polyphony limit if the streaming load is too high and raises it again if the disk recovered. */
+	void updatePolyphonyLimit(int numActiveVoices) const;
+
+	/** Creates the buffer pool and the voices. */
+	void createVoices();
+
+	/** Returns the amount of slots of the buffer pool. */
+	int getNumPoolSlots() const noexcept { return jmin(numVoicesToCreate, maxPolyphony + NUM_FADE_OUT_STREAM_SLOTS); };
+
+	/** Requests the preload size that every sound needs for the measured disk latency (within the budget). 
+	*
+	*	This is called by the adaption thread of the SharedStreamingEngine, which resizes the sounds.
+	*/
+	void addPreloadRequests(Array<SharedStreamingEngine::PreloadRequest> &requests) const;
+
+	friend class SharedStreamingEngine;
+
+	/** Returns the preload size that the sound should have (without the budget). */
+	int getWantedPreloadSize(const StreamingSamplerSound *sound) const;
+
+	/** Returns the smallest preload size. Shared sounds must fit the stream buffers of all samplers that use them. */
+	int getMinimumPreloadSize() const noexcept { return jmax(streamBufferSize, engine->getMinimumPreloadSize()); };
+
+	/** Renders voices until the shared counter reaches the end of the voice list. */
+	void renderVoiceShare(AudioSampleBuffer &targetBuffer, int startSample, int numSamples);
+
+	/** Renders all voices and collects the voices that can be rendered in batches. */
+	void renderVoicesInBatches(AudioSampleBuffer &outputBuffer, int startSample, int numSamples);
+
+	/** Renders the prepared voices of one batch chunk by chunk. */
+	void renderBatch(StreamingSamplerVoice **batchVoices, int numVoices, AudioSampleBuffer &outputBuffer, int startSample, int numSamples);
+
+	/** A thread that renders voices into its own buffer when it is woken up by the audio thread. */
+	class RenderThread: public Thread
+	{
+	public:
+
+		RenderThread(StreamingSampler &parent_, int maximumBlockSize);
+
+		~RenderThread();
+
+		void run() override;
+
+		/** The state of the thread for the current block. The audio thread sets it to jobAssigned and can take the job 
+		*	back (if the thread did not start yet) or wait until the thread is idle again.
+		*/
+		enum JobState
+		{
+			idle = 0,
+			jobAssigned,
+			rendering
+		};
+
+		Atomic<int> state;
+		AudioSampleBuffer buffer;
+
+		// The range of the current job (written by the audio thread before the job is assigned)
+		int startSample;
+		int numSamples;
+
+		// The audio thread wakes up the thread without a lock
+		WakeUpSemaphore wakeUp;
+
+	private:
+
+		StreamingSampler &parent;
+	};
+
+	OwnedArray<RenderThread> renderThreads;
+
+	// The voice index for the next thread that renders a voice
+	Atomic<int> nextVoiceToRender;
+
+	SharedStreamingEngine *engine;
+	StreamingThread *backgroundThread;
+
+	ScopedPointer<StreamingBufferPool> bufferPool;
+
+	int numVoicesToCreate;
+	int streamBufferSize;
+	int64 preloadBudget;
+	int64 inMemoryLength;
+
+	int maxPolyphony;
+	mutable int polyphonyLimit;
+
+	double maxStreamingLoad;
+	double stealFadeTimeMs;
+
+	// The note counter of the voices (only used by the audio thread)
+	uint32 noteCounter;
+
+	bool offlineMode;
+	bool batchRendering;
+
+	JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(StreamingSampler)
+};
+
 #endif  // STREAMINGSAMPLER_H_INCLUDED